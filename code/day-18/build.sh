@@ -1,4 +1,4 @@
 #!/bin/bash
 # Bash script
 mkdir -p ../build
-gcc  xcb_handmade.c -o ../build/handmade -O0 -lxcb -lxcb-xkb -lasound -lm -DHANDMADE_INTERNAL=1 -DHANDMADE_SLOW=1
+gcc  xcb_handmade.c -o ../build/handmade -O0 -lxcb -lxcb-xkb -lxcb-shm -lxcb-present -lxcb-render -lxcb-randr -lasound -lm -lpthread -DHANDMADE_INTERNAL=1 -DHANDMADE_SLOW=1
@@ -1,15 +1,30 @@
 #include <xcb/xcb.h>
 #include <xcb/xkb.h> /*Require libxcb-xkb-dev package installed*/
+#include <xcb/shm.h> /*Require libxcb-shm0-dev package installed*/
+#include <xcb/present.h> /*Require libxcb-present-dev package installed*/
+#include <xcb/render.h> /*Require libxcb-render0-dev package installed*/
+#include <xcb/randr.h> /*Require libxcb-randr0-dev package installed*/
 #include <alsa/asoundlib.h>
 #include <linux/joystick.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <malloc.h>
+#include <string.h>
 #include <math.h>
 #include <x86gprintrin.h>
+#include <immintrin.h>
 
 #define PI32 3.14159265359f
 
@@ -41,10 +56,163 @@ typedef u32 bool32;
 #include "xcb_handmade.h"
 
 #define BYTES_PER_PIXEL 4
+#define BACKBUFFER_COUNT 3
+#define DEFERRED_EVENT_COUNT 256
+#define TILE_SIZE 64
+
+//Note(LAG): A render width of 0 makes the game draw straight into the window sized backbuffer, anything else is the
+//fixed size the game draws at and the platform stretches to the window
+#if !defined(HANDMADE_RENDER_WIDTH)
+#define HANDMADE_RENDER_WIDTH  0
+#define HANDMADE_RENDER_HEIGHT 0
+#endif
+#if !defined(HANDMADE_RENDER_FILTER)
+#define HANDMADE_RENDER_FILTER STRETCH_FILTER_BILINEAR
+#endif
+#if !defined(HANDMADE_RENDER_LETTERBOX)
+#define HANDMADE_RENDER_LETTERBOX 1
+#endif
+#if !defined(HANDMADE_RENDER_SCALER)
+#define HANDMADE_RENDER_SCALER RENDER_SCALER_CPU
+#endif
+#define STRETCH_TABLE_COUNT 65536
+
+//Note(LAG): A headless build runs the game loop with no X server, sound device or joystick, for measuring the game on
+//machines without a display, a fixed step of 0 runs the frames back to back instead of at the game update rate
+#if !defined(HANDMADE_HEADLESS)
+#define HANDMADE_HEADLESS 0
+#endif
+#if !defined(HANDMADE_HEADLESS_FRAMES)
+#define HANDMADE_HEADLESS_FRAMES 600
+#endif
+#if !defined(HANDMADE_HEADLESS_FIXED_STEP)
+#define HANDMADE_HEADLESS_FIXED_STEP 0
+#endif
+
+//Note(LAG): Capture writes every frame the game draws to a file from a thread of its own, Y4M is 4:2:0 for viewing,
+//raw is the exact BGRX pixels for comparing runs
+#if !defined(HANDMADE_CAPTURE)
+#define HANDMADE_CAPTURE 0
+#endif
+#if !defined(HANDMADE_CAPTURE_FORMAT)
+#define HANDMADE_CAPTURE_FORMAT CAPTURE_FORMAT_Y4M
+#endif
+#if !defined(HANDMADE_CAPTURE_PATH)
+#define HANDMADE_CAPTURE_PATH "capture.y4m"
+#endif
+
+//Note(LAG): Backs the backbuffers and the game memory with 2MB pages, explicit hugetlbfs pages when the system has
+//some reserved and transparent huge pages otherwise. The benchmark build compares fills and blits on both and exits
+#if !defined(HANDMADE_HUGE_PAGES)
+#define HANDMADE_HUGE_PAGES 0
+#endif
+#if !defined(HANDMADE_PAGE_BENCHMARK)
+#define HANDMADE_PAGE_BENCHMARK 0
+#endif
+#define HUGE_PAGE_SIZE MEGABYTES(2)
+
+//Note(LAG): Telemetry prints one line per frame. Every syscall and X round trip the loop makes goes through these two,
+//so each line also shows how many of them the frame cost
+#if !defined(HANDMADE_TELEMETRY)
+#define HANDMADE_TELEMETRY 0
+#endif
+#if HANDMADE_TELEMETRY
+#define COUNTED_SYSCALL(...)    (++global_frame_stats.syscalls, __VA_ARGS__)
+#define COUNTED_ROUND_TRIP(...) (++global_frame_stats.round_trips, __VA_ARGS__)
+#else
+#define COUNTED_SYSCALL(...)    (__VA_ARGS__)
+#define COUNTED_ROUND_TRIP(...) (__VA_ARGS__)
+#endif
+
+//Note(LAG): The work queue hands the game a pool of one thread per extra online CPU through game_memory, the game's
+//handmade.h has to declare platform_work_queue, the callback types and the three game_memory fields for it
+#if !defined(HANDMADE_WORK_QUEUE)
+#define HANDMADE_WORK_QUEUE 0
+#endif
+
+//Note(LAG): With mmap access the game writes its samples straight into the device ring
+#if !defined(HANDMADE_ALSA_MMAP)
+#define HANDMADE_ALSA_MMAP 0
+#endif
+
+//Note(LAG): With the audio thread the game's samples go into a ring and a thread of its own keeps the device fed from it,
+//the loop keeps HANDMADE_AUDIO_RING_MS queued so a frame that late still plays. Real-time asks for SCHED_FIFO, which
+//needs CAP_SYS_NICE or an rtprio limit, without them the thread stays a normal one
+#if !defined(HANDMADE_AUDIO_THREAD)
+#define HANDMADE_AUDIO_THREAD 0
+#endif
+#if !defined(HANDMADE_AUDIO_REALTIME)
+#define HANDMADE_AUDIO_REALTIME 0
+#endif
+#if !defined(HANDMADE_AUDIO_RING_MS)
+#define HANDMADE_AUDIO_RING_MS 100
+#endif
+
+//Note(LAG): With the float bus the game mixes into interleaved stereo f32 and the platform converts it once per frame to
+//the widest format the device takes. handmade.h has to declare game_sound_output_buffer.samples as f32* to match
+#if !defined(HANDMADE_AUDIO_FLOAT)
+#define HANDMADE_AUDIO_FLOAT 0
+#endif
+
+//Note(LAG): Xruns grow the device buffer (or the ring target with the audio thread) by half when
+//HANDMADE_AUDIO_XRUN_GROW of them fall within HANDMADE_AUDIO_XRUN_WINDOW_MS, HANDMADE_AUDIO_STABLE_MS without one shrinks
+//it by an eighth. It stays between HANDMADE_AUDIO_MIN_MS (never under two game frames) and HANDMADE_AUDIO_MAX_MS.
+//Off by default, a direct device is resized by stopping it
+#if !defined(HANDMADE_AUDIO_ADAPTIVE)
+#define HANDMADE_AUDIO_ADAPTIVE 0
+#endif
+#if !defined(HANDMADE_AUDIO_XRUN_GROW)
+#define HANDMADE_AUDIO_XRUN_GROW 2
+#endif
+#if !defined(HANDMADE_AUDIO_XRUN_WINDOW_MS)
+#define HANDMADE_AUDIO_XRUN_WINDOW_MS 5000
+#endif
+#if !defined(HANDMADE_AUDIO_STABLE_MS)
+#define HANDMADE_AUDIO_STABLE_MS 10000
+#endif
+#if !defined(HANDMADE_AUDIO_MIN_MS)
+#define HANDMADE_AUDIO_MIN_MS 50
+#endif
+#if !defined(HANDMADE_AUDIO_MAX_MS)
+#define HANDMADE_AUDIO_MAX_MS 250
+#endif
+
+//Note(LAG): Draws the predicted and the actual play cursor at each flip over the game's frame, internal builds only
+#if !defined(HANDMADE_AUDIO_SYNC_OVERLAY)
+#define HANDMADE_AUDIO_SYNC_OVERLAY 0
+#endif
+
+//Note(LAG): With the event thread the X connection is read by a thread of its own that blocks in xcb_wait_for_event,
+//the loop only copies the translated records out of a ring
+#if !defined(HANDMADE_EVENT_THREAD)
+#define HANDMADE_EVENT_THREAD 0
+#endif
+
+//Note(LAG): While the window is unfocused, unmapped or fully covered the game is paused and the loop sleeps in poll()
+//on the X connection, waking up at least every HANDMADE_IDLE_TIMEOUT_MS
+#if !defined(HANDMADE_IDLE)
+#define HANDMADE_IDLE 1
+#endif
+#if !defined(HANDMADE_IDLE_TIMEOUT_MS)
+#define HANDMADE_IDLE_TIMEOUT_MS 250
+#endif
 
-GLOBAL_VARIABLE unsigned              is_running;
-GLOBAL_VARIABLE xxcb_offscreen_buffer global_backbuffer;
-GLOBAL_VARIABLE unsigned              keys_down[200];
+typedef u64 tile_hash_function(u8* memory, u32 row_bytes, u32 row_count, u32 pitch);
+typedef void stretch_function(xxcb_render_buffer* source, u8* destination, u32 destination_pitch, u32 width, u32 height);
+
+GLOBAL_VARIABLE unsigned               is_running;
+GLOBAL_VARIABLE xxcb_offscreen_buffer  global_backbuffers[BACKBUFFER_COUNT];
+GLOBAL_VARIABLE xxcb_offscreen_buffer* global_backbuffer;
+GLOBAL_VARIABLE u32                    global_backbuffer_count;
+GLOBAL_VARIABLE unsigned               keys_down[200];
+//Note(LAG): One per thread, COUNTED_SYSCALL on the audio and event threads counts into their own copy that is never
+//printed, so telemetry stays the main loop's frame cost
+GLOBAL_VARIABLE __thread xxcb_frame_stats global_frame_stats;
+GLOBAL_VARIABLE tile_hash_function*    tile_hash;
+GLOBAL_VARIABLE xxcb_render_buffer     global_render_buffer;
+GLOBAL_VARIABLE xxcb_offscreen_buffer  global_canonical_buffer;
+GLOBAL_VARIABLE stretch_function*      stretch_nearest;
+GLOBAL_VARIABLE stretch_function*      stretch_bilinear;
 
 GLOBAL_VARIABLE xcb_connection_t* _connection;
 GLOBAL_VARIABLE xcb_screen_t*     _screen;
@@ -52,8 +220,43 @@ GLOBAL_VARIABLE xcb_window_t      _window;
 GLOBAL_VARIABLE xcb_gcontext_t    _gcontext;
 GLOBAL_VARIABLE xcb_atom_t        _wm_protocols;
 GLOBAL_VARIABLE xcb_atom_t        _wm_delete_protocol;
+GLOBAL_VARIABLE u32               _maximum_request_bytes;
+GLOBAL_VARIABLE xxcb_pixel_format _pixel_format;
+GLOBAL_VARIABLE bool32            _shm_available;
+GLOBAL_VARIABLE u8                _shm_completion_event;
+
+GLOBAL_VARIABLE bool32                  _xrender_available;
+GLOBAL_VARIABLE xcb_pixmap_t            _xrender_source_pixmap;
+GLOBAL_VARIABLE xcb_render_picture_t    _xrender_source_picture;
+GLOBAL_VARIABLE xcb_render_picture_t    _xrender_window_picture;
+GLOBAL_VARIABLE xcb_render_transform_t  _xrender_transform;
+GLOBAL_VARIABLE bool32                  _xrender_letterbox;
+
+GLOBAL_VARIABLE bool32               _present_available;
+GLOBAL_VARIABLE xcb_special_event_t* _present_special_event;
+GLOBAL_VARIABLE xxcb_present_timing  _present_timing;
+
+GLOBAL_VARIABLE bool32 _randr_available;
+GLOBAL_VARIABLE u8     _randr_first_event;
+
+GLOBAL_VARIABLE xxcb_event_thread _event_thread;
+
+#if HANDMADE_WORK_QUEUE
+GLOBAL_VARIABLE platform_work_queue global_work_queue;
+#endif
 
-GLOBAL_VARIABLE snd_pcm_t* _pcm;
+//Note(LAG): Events read while waiting for a backbuffer to be released, handed back to the main loop in arrival order
+GLOBAL_VARIABLE xcb_generic_event_t* _deferred_events[DEFERRED_EVENT_COUNT];
+GLOBAL_VARIABLE u32                  _deferred_event_read;
+GLOBAL_VARIABLE u32                  _deferred_event_write;
+
+GLOBAL_VARIABLE snd_pcm_t*        _pcm;
+GLOBAL_VARIABLE bool32            _pcm_is_mmap;
+GLOBAL_VARIABLE xxcb_xrun_history _xrun_history;
+GLOBAL_VARIABLE snd_pcm_format_t  _pcm_format;
+
+GLOBAL_VARIABLE audio_convert_function* audio_convert;
+GLOBAL_VARIABLE xxcb_audio_thread _audio_thread;
 
 //Note(LAG): Do not test with __FILE__
 INTERNAL debug_read_file_result debug_platform_read_entire_file(char* filename) {
@@ -124,117 +327,2933 @@ INTERNAL bool32 debug_platform_write_entire_file(char* filename, u32 memory_size
 }
 
 INTERNAL void
-alsa_fill_sound_buffer(game_sound_output_buffer* sound_buffer) {
-   int result;
-   while((result = snd_pcm_writei(_pcm, sound_buffer->samples, sound_buffer->sample_count)) != sound_buffer->sample_count) {
-      if(result == -EPIPE) {
-         snd_pcm_prepare(_pcm);
+alsa_record_xrun(void) {
+   clock_gettime(CLOCK_MONOTONIC, &_xrun_history.times[_xrun_history.count % XRUN_HISTORY_COUNT]);
+   ++_xrun_history.count;
+   ++global_frame_stats.pcm_xruns;
+}
+
+INTERNAL snd_pcm_sframes_t
+alsa_writei(void* frames, snd_pcm_uframes_t frame_count) {
+   return _pcm_is_mmap ? snd_pcm_mmap_writei(_pcm, frames, frame_count) : snd_pcm_writei(_pcm, frames, frame_count);
+}
+
+//Note(LAG): Unlike a write, a commit does not start the stream once enough is queued, that is left to us
+INTERNAL snd_pcm_uframes_t
+alsa_mmap_commit(snd_pcm_uframes_t offset, snd_pcm_uframes_t frame_count) {
+   snd_pcm_sframes_t committed = COUNTED_SYSCALL(snd_pcm_mmap_commit(_pcm, offset, frame_count));
+   if(committed < 0) {
+      alsa_record_xrun();
+      COUNTED_SYSCALL(snd_pcm_recover(_pcm, committed, 1));
+      return 0;
+   }
+   if(COUNTED_SYSCALL(snd_pcm_state(_pcm)) == SND_PCM_STATE_PREPARED) {
+      COUNTED_SYSCALL(snd_pcm_start(_pcm));
+   }
+   return committed;
+}
+
+//Note(LAG): The device is non-blocking, a write takes what fits and for the rest we poll() its descriptors until the
+//deadline. Whatever is still left then is dropped, a frame is never held up spinning on -EAGAIN
+INTERNAL snd_pcm_uframes_t
+alsa_fill_sound_buffer(game_sound_output_buffer* sound_buffer, int timeout_ms) {
+   u8* frames = (u8*)sound_buffer->samples;
+   snd_pcm_uframes_t remaining = sound_buffer->sample_count;
+
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   while(remaining) {
+      snd_pcm_sframes_t written = COUNTED_SYSCALL(alsa_writei(frames, remaining));
+      if(written == -EPIPE || written == -ESTRPIPE) {
+         alsa_record_xrun();
+         if(COUNTED_SYSCALL(snd_pcm_recover(_pcm, written, 1)) < 0) {
+            //TODO(LAG): Diagnostic
+            break;
+         }
+         continue;
+      } else if(written >= 0) {
+         frames += snd_pcm_frames_to_bytes(_pcm, written);
+         remaining -= written;
+         if(!remaining) {
+            break;
+         }
+         ++global_frame_stats.pcm_short_writes;
+      } else if(written != -EAGAIN) {
+         //TODO(LAG): Diagnostic
+         break;
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      int elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / (1000 * 1000);
+      if(elapsed_ms >= timeout_ms) {
+         break;
+      }
+
+      struct pollfd descriptors[REACTOR_PCM_DESCRIPTOR_COUNT];
+      int descriptor_count = snd_pcm_poll_descriptors(_pcm, descriptors, REACTOR_PCM_DESCRIPTOR_COUNT);
+      if(descriptor_count <= 0 || COUNTED_SYSCALL(poll(descriptors, descriptor_count, timeout_ms - elapsed_ms)) <= 0) {
+         break;
+      }
+      unsigned short revents = 0;
+      COUNTED_SYSCALL(snd_pcm_poll_descriptors_revents(_pcm, descriptors, descriptor_count, &revents));
+      if(revents & (POLLERR | POLLNVAL)) {
+         //Note(LAG): POLLERR is how an xrun shows up here, the next write reports it and recovers
+         if(COUNTED_SYSCALL(snd_pcm_state(_pcm)) != SND_PCM_STATE_XRUN) {
+            break;
+         }
+      }
+      ++global_frame_stats.pcm_retries;
+   }
+   return sound_buffer->sample_count - remaining;
+}
+
+INTERNAL snd_pcm_hw_params_t*
+alsa_hw_params_alloc() {
+   return (snd_pcm_hw_params_t*)mmap(0,
+                                     snd_pcm_hw_params_sizeof(),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS,
+                                     -1,
+                                     0);
+}
+
+//Note(LAG): Only narrows the configuration space, nothing reaches the device until snd_pcm_hw_params
+INTERNAL snd_pcm_uframes_t
+alsa_refine_hw_params(snd_pcm_hw_params_t* _pcm_hw_params, int samples_per_second, int samples_per_write,
+                      bool32* is_mmap, snd_pcm_format_t* format) {
+   snd_pcm_hw_params_any(_pcm, _pcm_hw_params);
+
+   *is_mmap = HANDMADE_ALSA_MMAP && snd_pcm_hw_params_set_access(_pcm, _pcm_hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+   if(!*is_mmap) {
+      snd_pcm_hw_params_set_access(_pcm, _pcm_hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+   }
+   //Note(LAG): Best first, without the float bus the game's s16 goes to the device as is
+   LOCAL_PERSIST snd_pcm_format_t formats[] = {
+      SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S16_LE
+   };
+   *format = SND_PCM_FORMAT_S16_LE;
+   for(u32 format_index = HANDMADE_AUDIO_FLOAT ? 0 : ARRAY_COUNT(formats) - 1; format_index < ARRAY_COUNT(formats); ++format_index) {
+      if(snd_pcm_hw_params_test_format(_pcm, _pcm_hw_params, formats[format_index]) == 0) {
+         *format = formats[format_index];
+         break;
+      }
+   }
+   snd_pcm_hw_params_set_format(_pcm, _pcm_hw_params, *format);
+   snd_pcm_hw_params_set_channels(_pcm, _pcm_hw_params, 2);
+   snd_pcm_hw_params_set_rate(_pcm, _pcm_hw_params, samples_per_second, 0);
+   snd_pcm_uframes_t buffer_size = samples_per_write;
+   snd_pcm_hw_params_set_buffer_size_near(_pcm, _pcm_hw_params, &buffer_size);
+   snd_pcm_hw_params_set_period_time(_pcm, _pcm_hw_params, 100000, 0);
+
+   return buffer_size;
+}
+
+//Note(LAG): The buffer size the device would settle on for the request, asked without stopping it
+INTERNAL int
+alsa_accepted_buffer_size(int samples_per_second, int samples_per_write) {
+   LOCAL_PERSIST snd_pcm_hw_params_t* _pcm_hw_params;
+
+   if(!_pcm_hw_params) {
+      _pcm_hw_params = alsa_hw_params_alloc();
+   }
+   bool32 is_mmap;
+   snd_pcm_format_t format;
+   return alsa_refine_hw_params(_pcm_hw_params, samples_per_second, samples_per_write, &is_mmap, &format);
+}
+
+//Note(LAG): Can be run again on an open device once it is stopped, returns the buffer size the device settled on
+INTERNAL int
+alsa_configure(int samples_per_second, int samples_per_write) {
+   LOCAL_PERSIST snd_pcm_hw_params_t* _pcm_hw_params;
+
+   if(!_pcm_hw_params) {
+      _pcm_hw_params = alsa_hw_params_alloc();
+   }
+   samples_per_write = alsa_refine_hw_params(_pcm_hw_params, samples_per_second, samples_per_write, &_pcm_is_mmap, &_pcm_format);
+   snd_pcm_hw_params(_pcm, _pcm_hw_params);
+
+   //Note(LAG): The PCM descriptors report writable once a quarter of the buffer is free instead of a whole period
+   snd_pcm_sw_params_t* _pcm_sw_params;
+   snd_pcm_sw_params_alloca(&_pcm_sw_params);
+   snd_pcm_sw_params_current(_pcm, _pcm_sw_params);
+   snd_pcm_sw_params_set_avail_min(_pcm, _pcm_sw_params, samples_per_write / 4);
+   //Note(LAG): snd_pcm_status timestamps on the same clock as clock_gettime(CLOCK_MONOTONIC) for the cursor prediction
+   snd_pcm_sw_params_set_tstamp_mode(_pcm, _pcm_sw_params, SND_PCM_TSTAMP_ENABLE);
+   snd_pcm_sw_params_set_tstamp_type(_pcm, _pcm_sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+   snd_pcm_sw_params(_pcm, _pcm_sw_params);
+
+   return samples_per_write;
+}
+
+INTERNAL int
+alsa_init(int samples_per_second, int samples_per_write) {
+   if(snd_pcm_open(&_pcm, "default", SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0) {
+      //TODO(LAG) Diagnostic
+   }
+   return alsa_configure(samples_per_second, samples_per_write);
+}
+
+INTERNAL f32
+seconds_between(struct timespec start, struct timespec end) {
+   return (f32)(end.tv_sec - start.tv_sec) + (f32)(end.tv_nsec - start.tv_nsec) / (1000.0f*1000.0f*1000.0f);
+}
+
+INTERNAL void
+xrun_history_dump(xxcb_xrun_history* history, int descriptor) {
+   char char_buffer[128];
+   int length = sprintf(char_buffer, "%u xruns\n", history->count);
+   write(descriptor, char_buffer, length);
+   u32 first = history->count > XRUN_HISTORY_COUNT ? history->count - XRUN_HISTORY_COUNT : 0;
+   for(u32 xrun_index = first; xrun_index < history->count; ++xrun_index) {
+      struct timespec* time = &history->times[xrun_index % XRUN_HISTORY_COUNT];
+      length = sprintf(char_buffer, "  xrun %u at %ld.%03lds\n", xrun_index, (long)time->tv_sec, time->tv_nsec / (1000 * 1000));
+      write(descriptor, char_buffer, length);
+   }
+}
+
+//Note(LAG): Only xruns after the last change count towards growing again, the bigger buffer gets its own chance first
+INTERNAL u32
+audio_latency_adapt(xxcb_audio_latency* latency, xxcb_xrun_history* history, u32 current_frames) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   u32 frames = current_frames;
+   if(history->count >= HANDMADE_AUDIO_XRUN_GROW) {
+      struct timespec oldest = history->times[(history->count - HANDMADE_AUDIO_XRUN_GROW) % XRUN_HISTORY_COUNT];
+      if(seconds_between(oldest, now) * 1000.0f < HANDMADE_AUDIO_XRUN_WINDOW_MS &&
+         seconds_between(latency->last_change, oldest) > 0.0f) {
+         frames = current_frames + current_frames / 2;
+      }
+   }
+   if(frames == current_frames && seconds_between(latency->last_change, now) * 1000.0f > HANDMADE_AUDIO_STABLE_MS) {
+      struct timespec last_xrun = history->count ? history->times[(history->count - 1) % XRUN_HISTORY_COUNT] : latency->last_change;
+      if(seconds_between(last_xrun, now) * 1000.0f > HANDMADE_AUDIO_STABLE_MS) {
+         frames = current_frames - current_frames / 8;
+      }
+   }
+
+   frames = frames < latency->min_frames ? latency->min_frames : frames;
+   frames = frames > latency->max_frames ? latency->max_frames : frames;
+   if(frames != current_frames) {
+      latency->last_change = now;
+   }
+   return frames;
+}
+
+INTERNAL char*
+page_kind_name(page_kind kind) {
+   switch(kind) {
+      case PAGE_KIND_HUGETLB:     return "hugetlb 2MB";
+      case PAGE_KIND_TRANSPARENT: return "transparent huge";
+      default:                    return "4KB";
+   }
+}
+
+INTERNAL u64
+pages_size(u64 size, bool32 use_huge_pages) {
+   if(!use_huge_pages) {
+      return size;
+   }
+   return (size + HUGE_PAGE_SIZE - 1) & ~(u64)(HUGE_PAGE_SIZE - 1);
+}
+
+//Note(LAG): hugetlbfs pages are reserved by the mmap itself, so a pool that is too small fails here and not on first touch
+INTERNAL void*
+pages_allocate(u64 size, bool32 use_huge_pages, page_kind* kind) {
+   *kind = PAGE_KIND_NORMAL;
+   if(!use_huge_pages) {
+      void* memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      return memory == MAP_FAILED ? 0 : memory;
+   }
+
+   size = pages_size(size, use_huge_pages);
+   void* memory = mmap(0,
+                       size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT),
+                       -1,
+                       0);
+   if(memory != MAP_FAILED) {
+      *kind = PAGE_KIND_HUGETLB;
+      return memory;
+   }
+
+   //Note(LAG): Transparent huge pages only back 2MB aligned ranges, the mapping is made a page larger and trimmed
+   //to an aligned start
+   u8* reserve = mmap(0, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(reserve == MAP_FAILED) {
+      return 0;
+   }
+   u8* aligned = (u8*)(((uintptr_t)reserve + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+   if(aligned != reserve) {
+      munmap(reserve, aligned - reserve);
+   }
+   if(reserve + HUGE_PAGE_SIZE != aligned) {
+      munmap(aligned + size, reserve + HUGE_PAGE_SIZE - aligned);
+   }
+   if(madvise(aligned, size, MADV_HUGEPAGE) == 0) {
+      *kind = PAGE_KIND_TRANSPARENT;
+   }
+   return aligned;
+}
+
+INTERNAL void
+pages_free(void* memory, u64 size, bool32 use_huge_pages) {
+   munmap(memory, pages_size(size, use_huge_pages));
+}
+
+INTERNAL u32
+audio_ring_fill(xxcb_audio_ring* ring) {
+   return __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+}
+
+//Note(LAG): Only the loop writes and only the audio thread reads, whatever does not fit is dropped. With a converter the
+//frames are the float bus and are converted on their way in
+INTERNAL u32
+audio_ring_push(xxcb_audio_ring* ring, void* frames, u32 frame_count, audio_convert_function* convert) {
+   u32 write = __atomic_load_n(&ring->write, __ATOMIC_RELAXED);
+   u32 read  = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+   u32 space = ring->frame_count - (write - read);
+   if(frame_count > space) {
+      frame_count = space;
+   }
+
+   u32 start = write & (ring->frame_count - 1);
+   u32 first = ring->frame_count - start < frame_count ? ring->frame_count - start : frame_count;
+   if(convert) {
+      convert((f32*)frames, ring->memory + start * ring->bytes_per_frame, first * 2);
+      convert((f32*)frames + first * 2, ring->memory, (frame_count - first) * 2);
+   } else {
+      memcpy(ring->memory + start * ring->bytes_per_frame, frames, first * ring->bytes_per_frame);
+      memcpy(ring->memory, (u8*)frames + first * ring->bytes_per_frame, (frame_count - first) * ring->bytes_per_frame);
+   }
+
+   __atomic_store_n(&ring->write, write + frame_count, __ATOMIC_RELEASE);
+   return frame_count;
+}
+
+//Note(LAG): Called from the loop and from the audio thread
+INTERNAL u32
+alsa_write_silence(u32 frame_count, u32 bytes_per_frame) {
+   LOCAL_PERSIST u8 silence[4096];
+   u32 total_written = 0;
+   while(frame_count) {
+      u32 chunk = frame_count < sizeof(silence) / bytes_per_frame ? frame_count : sizeof(silence) / bytes_per_frame;
+      snd_pcm_sframes_t written = COUNTED_SYSCALL(alsa_writei(silence, chunk));
+      if(written < 0) {
+         COUNTED_SYSCALL(snd_pcm_recover(_pcm, written, 1));
+         break;
+      }
+      frame_count   -= written;
+      total_written += written;
+   }
+   return total_written;
+}
+
+//Note(LAG): Sleeps in poll() until the device has room, then hands it what the ring holds straight from the ring memory.
+//When the loop is behind it waits for it as long as the device has a quarter buffer left to play, after that the gap
+//is filled with silence so the device keeps running instead of underrunning
+INTERNAL void*
+audio_thread_proc(void* parameter) {
+   xxcb_audio_thread* audio_thread = (xxcb_audio_thread*)parameter;
+   xxcb_audio_ring* ring = &audio_thread->ring;
+   u32 low_watermark = audio_thread->device_frames / 4;
+
+   while(__atomic_load_n(&audio_thread->is_running, __ATOMIC_ACQUIRE)) {
+      int wait_result = snd_pcm_wait(_pcm, 100);
+      if(wait_result < 0) {
+         snd_pcm_recover(_pcm, wait_result, 1);
+         continue;
+      }
+      snd_pcm_sframes_t available = snd_pcm_avail_update(_pcm);
+      if(available < 0) {
+         snd_pcm_recover(_pcm, available, 1);
+         continue;
+      }
+      u32 queued = available < audio_thread->device_frames ? audio_thread->device_frames - available : 0;
+      __atomic_store_n(&audio_thread->device_queued, queued, __ATOMIC_RELEASE);
+
+      u32 fill = audio_ring_fill(ring);
+      if(fill == 0) {
+         if(queued > low_watermark) {
+            u64 wait_nsecs = (u64)(queued - low_watermark) * 1000 * 1000 * 1000 / audio_thread->samples_per_second;
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += wait_nsecs;
+            deadline.tv_sec  += deadline.tv_nsec / (1000 * 1000 * 1000);
+            deadline.tv_nsec %= 1000 * 1000 * 1000;
+            sem_timedwait(&audio_thread->frames_ready, &deadline);
+            continue;
+         }
+         u32 silence_frames = available < low_watermark ? available : low_watermark;
+         alsa_write_silence(silence_frames, ring->bytes_per_frame);
+         __atomic_add_fetch(&audio_thread->silence_frames, silence_frames, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      u32 frame_count = fill < available ? fill : available;
+      u32 read = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+      u32 start = read & (ring->frame_count - 1);
+      if(frame_count > ring->frame_count - start) {
+         frame_count = ring->frame_count - start;
+      }
+      snd_pcm_sframes_t written = alsa_writei(ring->memory + start * ring->bytes_per_frame, frame_count);
+      if(written < 0) {
+         if(written == -EPIPE || written == -ESTRPIPE) {
+            __atomic_add_fetch(&audio_thread->xruns, 1, __ATOMIC_RELAXED);
+         }
+         snd_pcm_recover(_pcm, written, 1);
+         continue;
+      }
+      if(written < frame_count) {
+         __atomic_add_fetch(&audio_thread->short_writes, 1, __ATOMIC_RELAXED);
+      }
+      __atomic_store_n(&ring->read, read + written, __ATOMIC_RELEASE);
+      __atomic_store_n(&audio_thread->device_queued, queued + written, __ATOMIC_RELEASE);
+   }
+   return 0;
+}
+
+INTERNAL bool32
+audio_thread_start(xxcb_audio_thread* audio_thread, alsa_sound_output* sound_output, u32 device_frames) {
+   u32 ring_target = sound_output->samples_per_second * HANDMADE_AUDIO_RING_MS / 1000;
+   u32 frame_count = 1;
+   while(frame_count < ring_target) {
+      frame_count <<= 1;
+   }
+
+   audio_thread->ring.frame_count     = frame_count;
+   audio_thread->ring.bytes_per_frame = sound_output->bytes_per_sample;
+   audio_thread->ring.memory = mmap(0,
+                                    frame_count * sound_output->bytes_per_sample,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS,
+                                    -1,
+                                    0);
+   //Note(LAG): On failure the ring is left zeroed, the loop falls back to writing itself and sizes its scratch without it
+   xxcb_audio_ring zero_ring = {};
+   if(audio_thread->ring.memory == MAP_FAILED) {
+      audio_thread->ring = zero_ring;
+      return FALSE;
+   }
+   audio_thread->ring_target        = ring_target;
+   audio_thread->device_frames      = device_frames;
+   audio_thread->samples_per_second = sound_output->samples_per_second;
+
+   sem_init(&audio_thread->frames_ready, 0, 0);
+   audio_thread->is_running = TRUE;
+   if(pthread_create(&audio_thread->thread, 0, audio_thread_proc, audio_thread) != 0) {
+      audio_thread->is_running = FALSE;
+      sem_destroy(&audio_thread->frames_ready);
+      munmap(audio_thread->ring.memory, frame_count * sound_output->bytes_per_sample);
+      audio_thread->ring = zero_ring;
+      return FALSE;
+   }
+
+   if(HANDMADE_AUDIO_REALTIME) {
+      struct sched_param schedule = {};
+      schedule.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+      audio_thread->is_realtime = pthread_setschedparam(audio_thread->thread, SCHED_FIFO, &schedule) == 0;
+      printf("audio thread: %s\n", audio_thread->is_realtime ? "SCHED_FIFO" : "SCHED_FIFO refused, normal priority");
+   }
+   return TRUE;
+}
+
+INTERNAL void
+audio_thread_stop(xxcb_audio_thread* audio_thread) {
+   __atomic_store_n(&audio_thread->is_running, FALSE, __ATOMIC_RELEASE);
+   sem_post(&audio_thread->frames_ready);
+   pthread_join(audio_thread->thread, 0);
+}
+
+//Note(LAG): The play cursor is where the hardware was when the status was taken (everything written minus the delay),
+//moved on by the time from then until the flip of the frame being built. The write ends a frame past that, plus a
+//safety margin for a late frame, so the sound of a frame starts playing as the frame shows up. The cursor at the last
+//flip is worked out the same way backwards from the new status and kept next to what was predicted for it
+INTERNAL int
+audio_sync_frames_to_write(xxcb_audio_sync* sync, snd_pcm_status_t* status, u32 samples_per_second,
+                           u32 samples_per_frame, f32 seconds_since_flip, f32 seconds_until_flip) {
+   snd_htimestamp_t status_time;
+   snd_pcm_status_get_htstamp(status, &status_time);
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   f32 status_age = (f32)(now.tv_sec - status_time.tv_sec) + (f32)(now.tv_nsec - status_time.tv_nsec) / (1000.0f*1000.0f*1000.0f);
+   if(status_time.tv_sec == 0 || status_age < 0.0f) {
+      //Note(LAG): Devices that do not timestamp their status report zero, the status is then as old as this call
+      status_age = 0.0f;
+   }
+
+   snd_pcm_sframes_t delay = snd_pcm_status_get_delay(status);
+   u64 play_cursor = sync->frames_written > (u64)delay ? sync->frames_written - delay : 0;
+
+   if(sync->has_prediction) {
+      u64 since_flip = (u64)((status_age + seconds_since_flip) * samples_per_second);
+      sync->markers[sync->marker_index].actual_flip_cursor = play_cursor > since_flip ? play_cursor - since_flip : 0;
+      sync->marker_index = (sync->marker_index + 1) % AUDIO_SYNC_MARKER_COUNT;
+   }
+
+   u32 safety_frames = samples_per_frame / 4;
+   f32 until_flip = status_age + (seconds_until_flip > 0.0f ? seconds_until_flip : 0.0f);
+   u64 predicted_flip_cursor = play_cursor + (u64)(until_flip * samples_per_second);
+   u64 write_end = predicted_flip_cursor + samples_per_frame + safety_frames;
+
+   int frames_to_write = write_end > sync->frames_written ? (int)(write_end - sync->frames_written) : 0;
+   snd_pcm_uframes_t available = snd_pcm_status_get_avail(status);
+   if(frames_to_write > (int)available) {
+      frames_to_write = (int)available;
+   }
+
+   xxcb_audio_sync_marker* marker = &sync->markers[sync->marker_index];
+   marker->play_cursor           = play_cursor;
+   marker->predicted_flip_cursor = predicted_flip_cursor;
+   marker->actual_flip_cursor    = 0;
+   marker->write_end             = sync->frames_written + frames_to_write;
+   sync->has_prediction = TRUE;
+
+   return frames_to_write;
+}
+
+#if HANDMADE_INTERNAL
+INTERNAL void
+debug_draw_vertical(game_offscreen_buffer* buffer, int x, int top, int bottom, u32 color) {
+   if(x < 0 || x >= buffer->width) {
+      return;
+   }
+   top    = top < 0 ? 0 : top;
+   bottom = bottom > buffer->height ? buffer->height : bottom;
+   u8* pixel = (u8*)buffer->memory + top * buffer->pitch + x * 4;
+   for(int y = top; y < bottom; ++y) {
+      *(u32*)pixel = color;
+      pixel += buffer->pitch;
+   }
+}
+
+//Note(LAG): One row per frame, oldest at the top and x wrapped on the device buffer. White is the play cursor when
+//the status was taken, yellow where it was predicted to be at the flip, green where it actually was and red the
+//end of the write
+INTERNAL void
+debug_draw_audio_sync(game_offscreen_buffer* buffer, xxcb_audio_sync* sync, u32 device_frames) {
+   int padding = 16;
+   int row_height = 4;
+   f32 scale = (f32)(buffer->width - 2 * padding) / (f32)device_frames;
+   for(u32 i = 0; i < AUDIO_SYNC_MARKER_COUNT; ++i) {
+      xxcb_audio_sync_marker* marker = &sync->markers[(sync->marker_index + 1 + i) % AUDIO_SYNC_MARKER_COUNT];
+      int top = padding + i * row_height;
+      int bottom = top + row_height;
+      if(i == AUDIO_SYNC_MARKER_COUNT - 1) {
+         bottom += 4 * row_height;
+      }
+      debug_draw_vertical(buffer, padding + (int)(scale * (marker->play_cursor % device_frames)), top, bottom, 0xFFFFFFFF);
+      debug_draw_vertical(buffer, padding + (int)(scale * (marker->write_end % device_frames)), top, bottom, 0xFFFF0000);
+      debug_draw_vertical(buffer, padding + (int)(scale * (marker->predicted_flip_cursor % device_frames)), top, bottom, 0xFFFFFF00);
+      if(marker->actual_flip_cursor) {
+         debug_draw_vertical(buffer, padding + (int)(scale * (marker->actual_flip_cursor % device_frames)), top, bottom, 0xFF00FF00);
+      }
+   }
+}
+#endif
+
+//Note(LAG): MIT-SHM only works when the client and the server share the same memory, any host in the display name
+//(including localhost, which is what ssh forwarding uses) is treated as remote and the slower xcb_put_image path is used
+INTERNAL bool32
+shm_query_support(void) {
+   char* host = 0;
+   int display;
+   int screen;
+   if(!xcb_parse_display(0, &host, &display, &screen)) {
+      return FALSE;
+   }
+   bool32 is_remote = host && host[0] && strcmp(host, "unix") != 0;
+   free(host);
+   if(is_remote) {
+      return FALSE;
+   }
+
+   const xcb_query_extension_reply_t* _extension = xcb_get_extension_data(_connection, &xcb_shm_id);
+   if(!_extension || !_extension->present) {
+      return FALSE;
+   }
+
+   xcb_shm_query_version_reply_t* _version_reply = xcb_shm_query_version_reply(_connection, xcb_shm_query_version(_connection), 0);
+   if(!_version_reply) {
+      return FALSE;
+   }
+   bool32 has_pixmaps = _version_reply->shared_pixmaps && _version_reply->pixmap_format == XCB_IMAGE_FORMAT_Z_PIXMAP;
+   free(_version_reply);
+   if(!has_pixmaps) {
+      return FALSE;
+   }
+
+   //Note(LAG): The extension can be present and still unable to attach our segments (e.g. a server in another container),
+   //so a small segment is attached once here and the result checked, this is the only round trip the SHM path needs
+   int shm_id = shmget(IPC_PRIVATE, 4096, IPC_CREAT | 0600);
+   if(shm_id == -1) {
+      return FALSE;
+   }
+   void* memory = shmat(shm_id, 0, 0);
+   shmctl(shm_id, IPC_RMID, 0);
+   if(memory == (void*)-1) {
+      return FALSE;
+   }
+
+   xcb_shm_seg_t _segment = xcb_generate_id(_connection);
+   xcb_generic_error_t* _error = xcb_request_check(_connection, xcb_shm_attach_checked(_connection, _segment, shm_id, 0));
+   bool32 result = TRUE;
+   if(_error) {
+      free(_error);
+      result = FALSE;
+   } else {
+      xcb_shm_detach(_connection, _segment);
+   }
+   shmdt(memory);
+
+   return result;
+}
+
+INTERNAL void*
+unflushed_shm_allocate(xcb_shm_seg_t* segment, u32 size, page_kind* kind) {
+   *kind = PAGE_KIND_NORMAL;
+   int shm_id = -1;
+   if(HANDMADE_HUGE_PAGES) {
+      shm_id = shmget(IPC_PRIVATE, pages_size(size, TRUE), IPC_CREAT | SHM_HUGETLB | 0600);
+      *kind = shm_id != -1 ? PAGE_KIND_HUGETLB : PAGE_KIND_NORMAL;
+   }
+   if(shm_id == -1) {
+      shm_id = shmget(IPC_PRIVATE, pages_size(size, HANDMADE_HUGE_PAGES), IPC_CREAT | 0600);
+   }
+   if(shm_id == -1) {
+      return 0;
+   }
+   void* memory = shmat(shm_id, 0, 0);
+   if(memory == (void*)-1) {
+      shmctl(shm_id, IPC_RMID, 0);
+      return 0;
+   }
+   //Note(LAG): Shared memory only gets transparent huge pages when shmem_enabled allows advise
+   if(HANDMADE_HUGE_PAGES && *kind == PAGE_KIND_NORMAL && madvise(memory, size, MADV_HUGEPAGE) == 0) {
+      *kind = PAGE_KIND_TRANSPARENT;
+   }
+
+   *segment = xcb_generate_id(_connection);
+   xcb_shm_attach(_connection, *segment, shm_id, 0);
+   //Note(LAG): Marked for removal right away, the segment is destroyed once both us and the server detach from it
+   shmctl(shm_id, IPC_RMID, 0);
+
+   return memory;
+}
+
+//Note(LAG): Rows sent to the server are padded to the scanline pad of the pixmap format, 32 bits on every server around
+INTERNAL u32
+pixel_format_pitch(u32 width) {
+   u32 row_bits = width * _pixel_format.bits_per_pixel;
+   return ((row_bits + _pixel_format.scanline_pad - 1) / _pixel_format.scanline_pad) * _pixel_format.scanline_pad / 8;
+}
+
+//Note(LAG): The game always draws BGRX 8888, every other layout the server can ask for gets a converter of its own,
+//the masks are known at compile time so each one is only shifts and masks
+INTERNAL void
+pixel_convert_rgb565_sse2(u32* source, u8* destination, u32 count) {
+   u16* destination_pixels = (u16*)destination;
+   u32 index = 0;
+   for(; index + 8 <= count; index += 8) {
+      __m128i pixels[2];
+      for(u32 half=0; half < 2; ++half) {
+         __m128i bgrx = _mm_loadu_si128((__m128i*)(source + index + half * 4));
+         __m128i red   = _mm_and_si128(_mm_srli_epi32(bgrx, 8), _mm_set1_epi32(0xF800));
+         __m128i green = _mm_and_si128(_mm_srli_epi32(bgrx, 5), _mm_set1_epi32(0x07E0));
+         __m128i blue  = _mm_and_si128(_mm_srli_epi32(bgrx, 3), _mm_set1_epi32(0x001F));
+         //Note(LAG): Sign extended so the signed pack keeps the upper half of the 565 range intact
+         pixels[half] = _mm_srai_epi32(_mm_slli_epi32(_mm_or_si128(red, _mm_or_si128(green, blue)), 16), 16);
+      }
+      _mm_storeu_si128((__m128i*)(destination_pixels + index), _mm_packs_epi32(pixels[0], pixels[1]));
+   }
+   for(; index < count; ++index) {
+      u32 bgrx = source[index];
+      destination_pixels[index] = ((bgrx >> 8) & 0xF800) | ((bgrx >> 5) & 0x07E0) | ((bgrx >> 3) & 0x001F);
+   }
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+pixel_convert_rgb565_avx2(u32* source, u8* destination, u32 count) {
+   u16* destination_pixels = (u16*)destination;
+   u32 index = 0;
+   for(; index + 16 <= count; index += 16) {
+      __m256i pixels[2];
+      for(u32 half=0; half < 2; ++half) {
+         __m256i bgrx = _mm256_loadu_si256((__m256i*)(source + index + half * 8));
+         __m256i red   = _mm256_and_si256(_mm256_srli_epi32(bgrx, 8), _mm256_set1_epi32(0xF800));
+         __m256i green = _mm256_and_si256(_mm256_srli_epi32(bgrx, 5), _mm256_set1_epi32(0x07E0));
+         __m256i blue  = _mm256_and_si256(_mm256_srli_epi32(bgrx, 3), _mm256_set1_epi32(0x001F));
+         pixels[half] = _mm256_srai_epi32(_mm256_slli_epi32(_mm256_or_si256(red, _mm256_or_si256(green, blue)), 16), 16);
+      }
+      //Note(LAG): The pack works per 128 bit lane, the permute puts the four quarters back in order
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(pixels[0], pixels[1]), _MM_SHUFFLE(3, 1, 2, 0));
+      _mm256_storeu_si256((__m256i*)(destination_pixels + index), packed);
+   }
+   pixel_convert_rgb565_sse2(source + index, (u8*)(destination_pixels + index), count - index);
+}
+
+//Note(LAG): The top two bits of each channel are repeated at the bottom so white stays white at 10 bits
+INTERNAL void
+pixel_convert_x2r10g10b10_sse2(u32* source, u8* destination, u32 count) {
+   u32* destination_pixels = (u32*)destination;
+   u32 index = 0;
+   for(; index + 4 <= count; index += 4) {
+      __m128i bgrx = _mm_loadu_si128((__m128i*)(source + index));
+      __m128i red   = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bgrx, _mm_set1_epi32(0xFF0000)), 6),
+                                   _mm_srli_epi32(_mm_and_si128(bgrx, _mm_set1_epi32(0xC00000)), 2));
+      __m128i green = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bgrx, _mm_set1_epi32(0x00FF00)), 4),
+                                   _mm_srli_epi32(_mm_and_si128(bgrx, _mm_set1_epi32(0x00C000)), 4));
+      __m128i blue  = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(bgrx, _mm_set1_epi32(0x0000FF)), 2),
+                                   _mm_srli_epi32(_mm_and_si128(bgrx, _mm_set1_epi32(0x0000C0)), 6));
+      _mm_storeu_si128((__m128i*)(destination_pixels + index), _mm_or_si128(red, _mm_or_si128(green, blue)));
+   }
+   for(; index < count; ++index) {
+      u32 bgrx = source[index];
+      destination_pixels[index] = ((bgrx & 0xFF0000) << 6) | ((bgrx & 0xC00000) >> 2) |
+                                  ((bgrx & 0x00FF00) << 4) | ((bgrx & 0x00C000) >> 4) |
+                                  ((bgrx & 0x0000FF) << 2) | ((bgrx & 0x0000C0) >> 6);
+   }
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+pixel_convert_x2r10g10b10_avx2(u32* source, u8* destination, u32 count) {
+   u32* destination_pixels = (u32*)destination;
+   u32 index = 0;
+   for(; index + 8 <= count; index += 8) {
+      __m256i bgrx = _mm256_loadu_si256((__m256i*)(source + index));
+      __m256i red   = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(bgrx, _mm256_set1_epi32(0xFF0000)), 6),
+                                      _mm256_srli_epi32(_mm256_and_si256(bgrx, _mm256_set1_epi32(0xC00000)), 2));
+      __m256i green = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(bgrx, _mm256_set1_epi32(0x00FF00)), 4),
+                                      _mm256_srli_epi32(_mm256_and_si256(bgrx, _mm256_set1_epi32(0x00C000)), 4));
+      __m256i blue  = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(bgrx, _mm256_set1_epi32(0x0000FF)), 2),
+                                      _mm256_srli_epi32(_mm256_and_si256(bgrx, _mm256_set1_epi32(0x0000C0)), 6));
+      _mm256_storeu_si256((__m256i*)(destination_pixels + index), _mm256_or_si256(red, _mm256_or_si256(green, blue)));
+   }
+   pixel_convert_x2r10g10b10_sse2(source + index, (u8*)(destination_pixels + index), count - index);
+}
+
+//Note(LAG): The bus is clamped to [-1, 1] before scaling, out of range floats would otherwise turn into 0x80000000 in
+//the conversion. 2^31 itself is not an s32, the top of the S32 range is the largest float below it
+INTERNAL s32
+audio_convert_scalar(f32 sample, f32 scale, f32 top) {
+   sample = sample < -1.0f ? -1.0f : (sample > 1.0f ? 1.0f : sample);
+   sample *= scale;
+   return (s32)(sample > top ? top : sample);
+}
+
+INTERNAL void
+audio_convert_s16_sse2(f32* source, u8* destination, u32 count) {
+   s16* destination_samples = (s16*)destination;
+   u32 index = 0;
+   for(; index + 8 <= count; index += 8) {
+      __m128i samples[2];
+      for(u32 half=0; half < 2; ++half) {
+         __m128 sample = _mm_loadu_ps(source + index + half * 4);
+         sample = _mm_min_ps(_mm_max_ps(sample, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+         samples[half] = _mm_cvtps_epi32(_mm_mul_ps(sample, _mm_set1_ps(32767.0f)));
+      }
+      _mm_storeu_si128((__m128i*)(destination_samples + index), _mm_packs_epi32(samples[0], samples[1]));
+   }
+   for(; index < count; ++index) {
+      destination_samples[index] = (s16)audio_convert_scalar(source[index], 32767.0f, 32767.0f);
+   }
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+audio_convert_s16_avx2(f32* source, u8* destination, u32 count) {
+   s16* destination_samples = (s16*)destination;
+   u32 index = 0;
+   for(; index + 16 <= count; index += 16) {
+      __m256i samples[2];
+      for(u32 half=0; half < 2; ++half) {
+         __m256 sample = _mm256_loadu_ps(source + index + half * 8);
+         sample = _mm256_min_ps(_mm256_max_ps(sample, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+         samples[half] = _mm256_cvtps_epi32(_mm256_mul_ps(sample, _mm256_set1_ps(32767.0f)));
+      }
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(samples[0], samples[1]), _MM_SHUFFLE(3, 1, 2, 0));
+      _mm256_storeu_si256((__m256i*)(destination_samples + index), packed);
+   }
+   audio_convert_s16_sse2(source + index, (u8*)(destination_samples + index), count - index);
+}
+
+//Note(LAG): S24_LE is 24 bits in the low three bytes of an s32, the same conversion as S32 with a smaller scale
+INTERNAL void
+audio_convert_s32_scaled_sse2(f32* source, s32* destination, u32 count, f32 scale, f32 top) {
+   u32 index = 0;
+   for(; index + 4 <= count; index += 4) {
+      __m128 sample = _mm_loadu_ps(source + index);
+      sample = _mm_min_ps(_mm_max_ps(sample, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+      sample = _mm_min_ps(_mm_mul_ps(sample, _mm_set1_ps(scale)), _mm_set1_ps(top));
+      _mm_storeu_si128((__m128i*)(destination + index), _mm_cvtps_epi32(sample));
+   }
+   for(; index < count; ++index) {
+      destination[index] = audio_convert_scalar(source[index], scale, top);
+   }
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+audio_convert_s32_scaled_avx2(f32* source, s32* destination, u32 count, f32 scale, f32 top) {
+   u32 index = 0;
+   for(; index + 8 <= count; index += 8) {
+      __m256 sample = _mm256_loadu_ps(source + index);
+      sample = _mm256_min_ps(_mm256_max_ps(sample, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+      sample = _mm256_min_ps(_mm256_mul_ps(sample, _mm256_set1_ps(scale)), _mm256_set1_ps(top));
+      _mm256_storeu_si256((__m256i*)(destination + index), _mm256_cvtps_epi32(sample));
+   }
+   audio_convert_s32_scaled_sse2(source + index, destination + index, count - index, scale, top);
+}
+
+INTERNAL void
+audio_convert_s32_sse2(f32* source, u8* destination, u32 count) {
+   audio_convert_s32_scaled_sse2(source, (s32*)destination, count, 2147483648.0f, 2147483520.0f);
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+audio_convert_s32_avx2(f32* source, u8* destination, u32 count) {
+   audio_convert_s32_scaled_avx2(source, (s32*)destination, count, 2147483648.0f, 2147483520.0f);
+}
+
+INTERNAL void
+audio_convert_s24_sse2(f32* source, u8* destination, u32 count) {
+   audio_convert_s32_scaled_sse2(source, (s32*)destination, count, 8388607.0f, 8388607.0f);
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+audio_convert_s24_avx2(f32* source, u8* destination, u32 count) {
+   audio_convert_s32_scaled_avx2(source, (s32*)destination, count, 8388607.0f, 8388607.0f);
+}
+
+//Note(LAG): A float device still gets the bus clamped, some drivers do not clip what is past full scale
+INTERNAL void
+audio_convert_float_sse2(f32* source, u8* destination, u32 count) {
+   f32* destination_samples = (f32*)destination;
+   u32 index = 0;
+   for(; index + 4 <= count; index += 4) {
+      __m128 sample = _mm_loadu_ps(source + index);
+      sample = _mm_min_ps(_mm_max_ps(sample, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+      _mm_storeu_ps(destination_samples + index, sample);
+   }
+   for(; index < count; ++index) {
+      f32 sample = source[index];
+      destination_samples[index] = sample < -1.0f ? -1.0f : (sample > 1.0f ? 1.0f : sample);
+   }
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+audio_convert_float_avx2(f32* source, u8* destination, u32 count) {
+   f32* destination_samples = (f32*)destination;
+   u32 index = 0;
+   for(; index + 8 <= count; index += 8) {
+      __m256 sample = _mm256_loadu_ps(source + index);
+      sample = _mm256_min_ps(_mm256_max_ps(sample, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+      _mm256_storeu_ps(destination_samples + index, sample);
+   }
+   audio_convert_float_sse2(source + index, (u8*)(destination_samples + index), count - index);
+}
+
+INTERNAL audio_convert_function*
+audio_convert_select(snd_pcm_format_t format, bool32 has_avx2) {
+   switch(format) {
+      case SND_PCM_FORMAT_FLOAT_LE: return has_avx2 ? audio_convert_float_avx2 : audio_convert_float_sse2;
+      case SND_PCM_FORMAT_S32_LE:   return has_avx2 ? audio_convert_s32_avx2   : audio_convert_s32_sse2;
+      case SND_PCM_FORMAT_S24_LE:   return has_avx2 ? audio_convert_s24_avx2   : audio_convert_s24_sse2;
+      default:                      return has_avx2 ? audio_convert_s16_avx2   : audio_convert_s16_sse2;
+   }
+}
+
+INTERNAL u32
+pixel_convert_channel(u32 value, u32 mask) {
+   u32 shift = __builtin_ctz(mask);
+   u32 bits  = __builtin_popcount(mask);
+   value = bits <= 8 ? value >> (8 - bits) : (value << (bits - 8)) | (value >> (16 - bits));
+   return (value << shift) & mask;
+}
+
+//Note(LAG): Anything without a dedicated converter, slow but correct for any masks in 16, 24 or 32 bits per pixel and
+//either image byte order
+INTERNAL void
+pixel_convert_generic(u32* source, u8* destination, u32 count) {
+   for(u32 index=0; index < count; ++index) {
+      u32 bgrx = source[index];
+      u32 pixel = pixel_convert_channel((bgrx >> 16) & 0xFF, _pixel_format.red_mask)   |
+                  pixel_convert_channel((bgrx >>  8) & 0xFF, _pixel_format.green_mask) |
+                  pixel_convert_channel((bgrx >>  0) & 0xFF, _pixel_format.blue_mask);
+      if(_pixel_format.bits_per_pixel == 16) {
+         ((u16*)destination)[index] = _pixel_format.is_msb_first ? __builtin_bswap16((u16)pixel) : (u16)pixel;
+      } else if(_pixel_format.bits_per_pixel == 24) {
+         u8* at = destination + index * 3;
+         at[_pixel_format.is_msb_first ? 2 : 0] = (u8)(pixel >>  0);
+         at[1]                                  = (u8)(pixel >>  8);
+         at[_pixel_format.is_msb_first ? 0 : 2] = (u8)(pixel >> 16);
+      } else {
+         ((u32*)destination)[index] = _pixel_format.is_msb_first ? __builtin_bswap32(pixel) : pixel;
+      }
+   }
+}
+
+//Note(LAG): False for layouts nothing here can draw, indexed 8 bits per pixel and smaller
+INTERNAL bool32
+pixel_format_init(xxcb_pixel_format* format, bool32 has_avx2) {
+   const xcb_setup_t* _setup = xcb_get_setup(_connection);
+
+   format->depth          = _screen->root_depth;
+   format->bits_per_pixel = 32;
+   format->scanline_pad   = 32;
+   xcb_format_iterator_t _format_iterator = xcb_setup_pixmap_formats_iterator(_setup);
+   for(; _format_iterator.rem; xcb_format_next(&_format_iterator)) {
+      if(_format_iterator.data->depth == _screen->root_depth) {
+         format->bits_per_pixel = _format_iterator.data->bits_per_pixel;
+         format->scanline_pad   = _format_iterator.data->scanline_pad;
+      }
+   }
+
+   xcb_depth_iterator_t _depth_iterator = xcb_screen_allowed_depths_iterator(_screen);
+   for(; _depth_iterator.rem; xcb_depth_next(&_depth_iterator)) {
+      xcb_visualtype_iterator_t _visual_iterator = xcb_depth_visuals_iterator(_depth_iterator.data);
+      for(; _visual_iterator.rem; xcb_visualtype_next(&_visual_iterator)) {
+         if(_visual_iterator.data->visual_id == _screen->root_visual) {
+            format->red_mask   = _visual_iterator.data->red_mask;
+            format->green_mask = _visual_iterator.data->green_mask;
+            format->blue_mask  = _visual_iterator.data->blue_mask;
+         }
+      }
+   }
+
+   format->is_msb_first = _setup->image_byte_order != XCB_IMAGE_ORDER_LSB_FIRST;
+   format->convert = 0;
+   if(!format->red_mask || !format->green_mask || !format->blue_mask ||
+      (format->bits_per_pixel != 16 && format->bits_per_pixel != 24 && format->bits_per_pixel != 32)) {
+      return FALSE;
+   } else if(format->is_msb_first || format->bits_per_pixel == 24) {
+      //Note(LAG): The dedicated converters all write whole little endian 16 or 32 bit pixels
+      format->convert = pixel_convert_generic;
+   } else if(format->bits_per_pixel == 32 &&
+      format->red_mask == 0xFF0000 && format->green_mask == 0x00FF00 && format->blue_mask == 0x0000FF) {
+      //Note(LAG): Same as what the game draws, nothing to convert
+   } else if(format->bits_per_pixel == 16 &&
+             format->red_mask == 0xF800 && format->green_mask == 0x07E0 && format->blue_mask == 0x001F) {
+      format->convert = has_avx2 ? pixel_convert_rgb565_avx2 : pixel_convert_rgb565_sse2;
+   } else if(format->bits_per_pixel == 32 &&
+             format->red_mask == 0x3FF00000 && format->green_mask == 0x000FFC00 && format->blue_mask == 0x000003FF) {
+      format->convert = has_avx2 ? pixel_convert_x2r10g10b10_avx2 : pixel_convert_x2r10g10b10_sse2;
+   } else {
+      format->convert = pixel_convert_generic;
+   }
+   return TRUE;
+}
+
+INTERNAL void
+pixel_convert_buffer(xxcb_offscreen_buffer* source, xxcb_offscreen_buffer* destination) {
+   u8* source_row      = (u8*)source->pixels;
+   u8* destination_row = (u8*)destination->pixels;
+   for(u32 y=0; y < destination->height; ++y) {
+      _pixel_format.convert((u32*)source_row, destination_row, destination->width);
+      source_row      += source->pitch;
+      destination_row += destination->pitch;
+   }
+}
+
+//Note(LAG): The BGRX buffer the game draws into when the server wants another layout, reserved once like the backbuffers
+INTERNAL void
+resize_canonical_buffer(xxcb_offscreen_buffer* buffer, u16 width, u16 height) {
+   if(width > buffer->reserved_width || height > buffer->reserved_height) {
+      if(buffer->pixels) {
+         pages_free(buffer->pixels, buffer->reserved_width * buffer->reserved_height * BYTES_PER_PIXEL, HANDMADE_HUGE_PAGES);
+      }
+      buffer->reserved_width  = width  > _screen->width_in_pixels  ? width  : _screen->width_in_pixels;
+      buffer->reserved_height = height > _screen->height_in_pixels ? height : _screen->height_in_pixels;
+      buffer->pixels = pages_allocate(buffer->reserved_width * buffer->reserved_height * BYTES_PER_PIXEL,
+                                      HANDMADE_HUGE_PAGES,
+                                      &buffer->pages);
+   }
+   buffer->width  = width;
+   buffer->height = height;
+   buffer->pitch  = width * BYTES_PER_PIXEL;
+}
+
+INTERNAL u32
+tile_count(u32 pixel_count) {
+   return (pixel_count + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+//Note(LAG): Memory is reserved once for the largest size the buffer can get, resizes only re-view it with a new pitch
+//and recreate the server pixmap, so a drag-resize does not touch mmap or the shared memory segments again
+INTERNAL void
+unflushed_reserve_backbuffer(xxcb_offscreen_buffer* buffer, u16 width, u16 height) {
+   if(buffer->pixels) {
+      if(buffer->shm_segment) {
+         xcb_shm_detach(_connection, buffer->shm_segment);
+         shmdt(buffer->pixels);
+         __atomic_store_n(&buffer->shm_segment, 0, __ATOMIC_RELEASE);
+      } else {
+         pages_free(buffer->pixels, pixel_format_pitch(buffer->reserved_width) * buffer->reserved_height, HANDMADE_HUGE_PAGES);
+         munmap(buffer->tile_hashes, tile_count(buffer->reserved_width) * tile_count(buffer->reserved_height) * sizeof(u64));
+         munmap(buffer->tile_scratch, pixel_format_pitch(buffer->reserved_width) * TILE_SIZE);
+         buffer->tile_hashes = 0;
+         buffer->tile_scratch = 0;
+      }
+      buffer->pixels = 0;
+   }
+
+   //Note(LAG): The server handles requests in order, so any read still pending on the old segment finishes before the detach.
+   //The segment id is read by the event thread's completions, so it is published atomically like is_busy
+   __atomic_store_n(&buffer->is_busy, FALSE, __ATOMIC_RELEASE);
+   buffer->presented_pixmap = XCB_NONE;
+   buffer->reserved_width  = width;
+   buffer->reserved_height = height;
+
+   if(_shm_available) {
+      xcb_shm_seg_t shm_segment = 0;
+      buffer->pixels = unflushed_shm_allocate(&shm_segment, pixel_format_pitch(width) * height, &buffer->pages);
+      __atomic_store_n(&buffer->shm_segment, shm_segment, __ATOMIC_RELEASE);
+   }
+
+   if(!buffer->pixels) {
+      buffer->pixels = pages_allocate(pixel_format_pitch(width) * height, HANDMADE_HUGE_PAGES, &buffer->pages);
+
+      //Note(LAG): Only the xcb_put_image path pays per uploaded byte, so only it keeps the tile hashes of what the pixmap holds
+      buffer->tile_hashes = mmap(0,
+                                 tile_count(width) * tile_count(height) * sizeof(u64),
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS,
+                                 -1,
+                                 0);
+      buffer->tile_scratch = mmap(0,
+                                  pixel_format_pitch(width) * TILE_SIZE,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS,
+                                  -1,
+                                  0);
+   }
+
+   if(HANDMADE_HUGE_PAGES) {
+      printf("backbuffer %ux%u: %s pages\n", width, height, page_kind_name(buffer->pages));
+   }
+}
+
+INTERNAL void
+unflushed_resize_backbuffer(xxcb_offscreen_buffer* buffer, u16 width, u16 height) {
+   if(width > buffer->reserved_width || height > buffer->reserved_height) {
+      u16 reserved_width  = width  > _screen->width_in_pixels  ? width  : _screen->width_in_pixels;
+      u16 reserved_height = height > _screen->height_in_pixels ? height : _screen->height_in_pixels;
+      if(reserved_width < buffer->reserved_width) {
+         reserved_width = buffer->reserved_width;
+      }
+      if(reserved_height < buffer->reserved_height) {
+         reserved_height = buffer->reserved_height;
+      }
+      unflushed_reserve_backbuffer(buffer, reserved_width, reserved_height);
+   }
+
+   if(buffer->pixmap) {
+      xcb_free_pixmap(_connection, buffer->pixmap);
+   }
+
+   buffer->width  = width;
+   buffer->height = height;
+   buffer->pitch  = pixel_format_pitch(width);
+   buffer->pixmap = xcb_generate_id(_connection);
+
+   if(buffer->shm_segment) {
+      xcb_shm_create_pixmap(_connection, buffer->pixmap, _window, width, height, _screen->root_depth, buffer->shm_segment, 0);
+   } else {
+      xcb_create_pixmap(_connection, _screen->root_depth, buffer->pixmap, _window, width, height);
+      buffer->tiles_valid = FALSE;
+   }
+}
+
+INTERNAL u64
+tile_hash_mix(u64 value) {
+   value ^= value >> 33;
+   value *= 0xFF51AFD7ED558CCDULL;
+   value ^= value >> 33;
+   value *= 0xC4CEB9FE1A85EC53ULL;
+   value ^= value >> 33;
+   return value;
+}
+
+//Note(LAG): Multiply-accumulate in the style of XXH3, the key moves on every chunk so the same pixels in a different
+//place of the tile (a sprite moving a few pixels) do not end up with the same hash
+INTERNAL u64
+tile_hash_sse2(u8* memory, u32 row_bytes, u32 row_count, u32 pitch) {
+   __m128i accumulator = _mm_set_epi64x(0x9E3779B185EBCA87LL, 0x165667B19E3779F9LL);
+   __m128i key         = _mm_set_epi32(0x1CAD21F7, 0x2F9E2C3D, 0x7C01812C, 0xBE4BA423);
+   __m128i key_step    = _mm_set_epi32(0x27D4EB2F, 0x165667B1, 0x61C88647, 0x2545F491);
+   u64 tail = 0;
+
+   for(u32 row=0; row < row_count; ++row) {
+      u8* at = memory + row * pitch;
+      u32 chunk_count = row_bytes / sizeof(__m128i);
+      for(u32 chunk=0; chunk < chunk_count; ++chunk) {
+         __m128i data      = _mm_loadu_si128((__m128i*)at);
+         __m128i data_key  = _mm_xor_si128(data, key);
+         __m128i product   = _mm_mul_epu32(data_key, _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+         __m128i data_swap = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+         accumulator = _mm_add_epi64(accumulator, _mm_add_epi64(product, data_swap));
+         key = _mm_add_epi32(key, key_step);
+         at += sizeof(__m128i);
+      }
+      u32 byte_index = chunk_count * sizeof(__m128i);
+      for(; byte_index + sizeof(u32) <= row_bytes; byte_index += sizeof(u32)) {
+         tail = tile_hash_mix(tail ^ *(u32*)at ^ ((u64)row << 32 | byte_index));
+         at += sizeof(u32);
+      }
+      if(byte_index < row_bytes) {
+         //Note(LAG): Odd width tiles at 16 bits per pixel end on half a u32, a whole one would read past the row
+         tail = tile_hash_mix(tail ^ *(u16*)at ^ ((u64)row << 32 | byte_index));
+      }
+   }
+
+   u64 lanes[2];
+   _mm_storeu_si128((__m128i*)lanes, accumulator);
+   return tile_hash_mix(lanes[0] ^ tile_hash_mix(lanes[1] ^ tail));
+}
+
+__attribute__((target("avx2"))) INTERNAL u64
+tile_hash_avx2(u8* memory, u32 row_bytes, u32 row_count, u32 pitch) {
+   __m256i accumulator = _mm256_set_epi64x(0x9E3779B185EBCA87LL, 0x165667B19E3779F9LL, 0xC2B2AE3D27D4EB4FLL, 0x85EBCA77C2B2AE63LL);
+   __m256i key         = _mm256_set_epi32(0x1CAD21F7, 0x2F9E2C3D, 0x7C01812C, 0xBE4BA423, 0xF7C9AC45, 0x5D3C1F8A, 0x3A6B2E47, 0x8E1D7F93);
+   __m256i key_step    = _mm256_set_epi32(0x27D4EB2F, 0x165667B1, 0x61C88647, 0x2545F491, 0x9E3779B9, 0x85EBCA6B, 0xC2B2AE35, 0x3C6EF372);
+   u64 tail = 0;
+
+   for(u32 row=0; row < row_count; ++row) {
+      u8* at = memory + row * pitch;
+      u32 chunk_count = row_bytes / sizeof(__m256i);
+      for(u32 chunk=0; chunk < chunk_count; ++chunk) {
+         __m256i data      = _mm256_loadu_si256((__m256i*)at);
+         __m256i data_key  = _mm256_xor_si256(data, key);
+         __m256i product   = _mm256_mul_epu32(data_key, _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)));
+         __m256i data_swap = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+         accumulator = _mm256_add_epi64(accumulator, _mm256_add_epi64(product, data_swap));
+         key = _mm256_add_epi32(key, key_step);
+         at += sizeof(__m256i);
+      }
+      u32 byte_index = chunk_count * sizeof(__m256i);
+      for(; byte_index + sizeof(u32) <= row_bytes; byte_index += sizeof(u32)) {
+         tail = tile_hash_mix(tail ^ *(u32*)at ^ ((u64)row << 32 | byte_index));
+         at += sizeof(u32);
+      }
+      if(byte_index < row_bytes) {
+         tail = tile_hash_mix(tail ^ *(u16*)at ^ ((u64)row << 32 | byte_index));
+      }
+   }
+
+   u64 lanes[4];
+   _mm256_storeu_si256((__m256i*)lanes, accumulator);
+   return tile_hash_mix(lanes[0] ^ tile_hash_mix(lanes[1] ^ tile_hash_mix(lanes[2] ^ tile_hash_mix(lanes[3] ^ tail))));
+}
+
+//Note(LAG): Uploads a rectangle of the buffer to its pixmap, rows are packed in the scratch when the rectangle is narrower than
+//the buffer and split in bands since a single request can not be bigger than what the server accepts
+//(16MB with BIG-REQUESTS, 256KB without), all of them are queued and written by the same flush
+INTERNAL void
+unflushed_put_image_rect(xxcb_offscreen_buffer* buffer, u16 x, u16 y, u16 width, u16 height) {
+   u32 pixel_bytes = _pixel_format.bits_per_pixel / 8;
+   u32 row_bytes = pixel_format_pitch(width);
+   //Note(LAG): Past 65535 units BIG-REQUESTS adds a length word that xcb does not count against the maximum
+   u32 rows_per_band = (_maximum_request_bytes - sizeof(xcb_put_image_request_t) - 4) / row_bytes;
+   if(rows_per_band == 0) {
+      rows_per_band = 1;
+   }
+   bool32 needs_packing = width != buffer->width;
+   if(needs_packing && rows_per_band > TILE_SIZE) {
+      rows_per_band = TILE_SIZE;
+   }
+
+   for(u32 band_y=0; band_y < height; band_y += rows_per_band) {
+      u32 band_height = height - band_y;
+      if(band_height > rows_per_band) {
+         band_height = rows_per_band;
+      }
+
+      u8* band = (u8*)buffer->pixels + (y + band_y) * buffer->pitch + x * pixel_bytes;
+      if(needs_packing) {
+         for(u32 row=0; row < band_height; ++row) {
+            memcpy(buffer->tile_scratch + row * row_bytes, band + row * buffer->pitch, width * pixel_bytes);
+         }
+         band = buffer->tile_scratch;
+      }
+
+      xcb_put_image(_connection,
+                    XCB_IMAGE_FORMAT_Z_PIXMAP,
+                    buffer->pixmap,
+                    _gcontext,
+                    width, band_height,
+                    x, y + band_y,
+                    0,
+                    _screen->root_depth,
+                    band_height * row_bytes, band);
+   }
+}
+
+//Note(LAG): Hashes every tile against what was last uploaded and sends only the runs of changed tiles of each tile row,
+//a static scene costs the hashing and nothing on the wire
+INTERNAL void
+unflushed_upload_dirty_tiles(xxcb_offscreen_buffer* buffer) {
+   u32 pixel_bytes  = _pixel_format.bits_per_pixel / 8;
+   u32 tile_count_x = tile_count(buffer->width);
+   u32 tile_count_y = tile_count(buffer->height);
+
+   for(u32 tile_row=0; tile_row < tile_count_y; ++tile_row) {
+      u32 tile_y      = tile_row * TILE_SIZE;
+      u32 tile_height = buffer->height - tile_y < TILE_SIZE ? buffer->height - tile_y : TILE_SIZE;
+      s32 run_start   = -1;
+
+      for(u32 tile_column=0; tile_column <= tile_count_x; ++tile_column) {
+         bool32 is_dirty = FALSE;
+         if(tile_column < tile_count_x) {
+            u32 tile_x     = tile_column * TILE_SIZE;
+            u32 tile_width = buffer->width - tile_x < TILE_SIZE ? buffer->width - tile_x : TILE_SIZE;
+            u64 hash = tile_hash((u8*)buffer->pixels + tile_y * buffer->pitch + tile_x * pixel_bytes,
+                                 tile_width * pixel_bytes,
+                                 tile_height,
+                                 buffer->pitch);
+
+            u64* last_hash = &buffer->tile_hashes[tile_row * tile_count_x + tile_column];
+            is_dirty = !buffer->tiles_valid || *last_hash != hash;
+            *last_hash = hash;
+
+            ++global_frame_stats.tiles_total;
+            global_frame_stats.tiles_dirty += is_dirty ? 1 : 0;
+         }
+
+         if(is_dirty && run_start < 0) {
+            run_start = tile_column;
+         } else if(!is_dirty && run_start >= 0) {
+            u32 run_x   = run_start * TILE_SIZE;
+            u32 run_end = tile_column * TILE_SIZE < buffer->width ? tile_column * TILE_SIZE : buffer->width;
+            unflushed_put_image_rect(buffer, run_x, tile_y, run_end - run_x, tile_height);
+            run_start = -1;
+         }
+      }
+   }
+
+   buffer->tiles_valid = TRUE;
+}
+
+INTERNAL void
+render_buffer_init(xxcb_render_buffer* buffer, u16 width, u16 height, stretch_filter filter, bool32 letterbox) {
+   buffer->width     = width;
+   buffer->height    = height;
+   buffer->pitch     = width * BYTES_PER_PIXEL;
+   buffer->filter    = filter;
+   buffer->letterbox = letterbox;
+
+   //Note(LAG): The row scratch has one extra pixel so the bilinear kernel can always read a pair, even on the last column
+   u32 pixels_size  = width * height * BYTES_PER_PIXEL;
+   u32 scratch_size = (width + 1) * BYTES_PER_PIXEL;
+   u32 tables_size  = STRETCH_TABLE_COUNT * (sizeof(u32) + sizeof(u16));
+   u8* memory = mmap(0,
+                     pixels_size + scratch_size + tables_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+   buffer->pixels         = memory;
+   buffer->row_scratch    = (u32*)(memory + pixels_size);
+   buffer->column_sources = (u32*)(memory + pixels_size + scratch_size);
+   buffer->column_weights = (u16*)(buffer->column_sources + STRETCH_TABLE_COUNT);
+}
+
+//Note(LAG): Sources are sampled at the pixel centers, in 16.16 fixed point for the bilinear filter so the low byte of the
+//fraction becomes the weight of the right (or lower) pixel out of 256
+INTERNAL u32
+stretch_source_fixed(u32 destination, u32 source_count, u32 destination_count) {
+   s64 fixed = ((s64)(2 * destination + 1) * source_count * 65536) / (2 * destination_count) - 32768;
+   if(fixed < 0) {
+      fixed = 0;
+   } else if(fixed > (s64)(source_count - 1) * 65536) {
+      fixed = (s64)(source_count - 1) * 65536;
+   }
+   return (u32)fixed;
+}
+
+INTERNAL void
+stretch_build_columns(xxcb_render_buffer* source, u32 width) {
+   if(source->table_width == width && source->table_filter == source->filter) {
+      return;
+   }
+
+   for(u32 x=0; x < width; ++x) {
+      if(source->filter == STRETCH_FILTER_NEAREST) {
+         source->column_sources[x] = ((2 * x + 1) * source->width) / (2 * width);
+         source->column_weights[x] = 0;
+      } else {
+         u32 fixed = stretch_source_fixed(x, source->width, width);
+         source->column_sources[x] = fixed >> 16;
+         source->column_weights[x] = (fixed >> 8) & 0xFF;
+      }
+   }
+   source->table_width  = width;
+   source->table_filter = source->filter;
+}
+
+INTERNAL void
+stretch_nearest_sse2(xxcb_render_buffer* source, u8* destination, u32 destination_pitch, u32 width, u32 height) {
+   u32* columns = source->column_sources;
+   s32  last_source_y = -1;
+
+   for(u32 y=0; y < height; ++y) {
+      u32* destination_row = (u32*)(destination + y * destination_pitch);
+      s32  source_y = ((2 * y + 1) * source->height) / (2 * height);
+
+      //Note(LAG): When scaling up, consecutive rows come from the same source row and are a plain copy of the previous one
+      if(source_y == last_source_y) {
+         memcpy(destination_row, destination + (y - 1) * destination_pitch, width * BYTES_PER_PIXEL);
+         continue;
+      }
+      last_source_y = source_y;
+
+      u32* source_row = (u32*)((u8*)source->pixels + source_y * source->pitch);
+      u32 x = 0;
+      for(; x + 4 <= width; x += 4) {
+         __m128i pixels = _mm_set_epi32(source_row[columns[x + 3]],
+                                        source_row[columns[x + 2]],
+                                        source_row[columns[x + 1]],
+                                        source_row[columns[x + 0]]);
+         _mm_storeu_si128((__m128i*)(destination_row + x), pixels);
+      }
+      for(; x < width; ++x) {
+         destination_row[x] = source_row[columns[x]];
+      }
+   }
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+stretch_nearest_avx2(xxcb_render_buffer* source, u8* destination, u32 destination_pitch, u32 width, u32 height) {
+   u32* columns = source->column_sources;
+   s32  last_source_y = -1;
+
+   for(u32 y=0; y < height; ++y) {
+      u32* destination_row = (u32*)(destination + y * destination_pitch);
+      s32  source_y = ((2 * y + 1) * source->height) / (2 * height);
+
+      if(source_y == last_source_y) {
+         memcpy(destination_row, destination + (y - 1) * destination_pitch, width * BYTES_PER_PIXEL);
+         continue;
+      }
+      last_source_y = source_y;
+
+      u32* source_row = (u32*)((u8*)source->pixels + source_y * source->pitch);
+      u32 x = 0;
+      for(; x + 8 <= width; x += 8) {
+         __m256i indices = _mm256_loadu_si256((__m256i*)(columns + x));
+         __m256i pixels  = _mm256_i32gather_epi32((int*)source_row, indices, 4);
+         _mm256_storeu_si256((__m256i*)(destination_row + x), pixels);
+      }
+      for(; x < width; ++x) {
+         destination_row[x] = source_row[columns[x]];
+      }
+   }
+}
+
+//Note(LAG): Bilinear is done in two passes, the two source rows are blended into the row scratch once per source row and
+//weight, then every destination pixel blends a pair of the scratch, all in 8 bit weights over 16 bit lanes
+INTERNAL void
+stretch_bilinear_sse2(xxcb_render_buffer* source, u8* destination, u32 destination_pitch, u32 width, u32 height) {
+   u32*    columns = source->column_sources;
+   u16*    weights = source->column_weights;
+   u32*    scratch = source->row_scratch;
+   __m128i zero    = _mm_setzero_si128();
+   u32     last_fixed = 0xFFFFFFFF;
+
+   for(u32 y=0; y < height; ++y) {
+      u32 fixed = stretch_source_fixed(y, source->height, height) & 0xFFFFFF00;
+      if(fixed != last_fixed) {
+         last_fixed = fixed;
+
+         u32 source_y0 = fixed >> 16;
+         u32 source_y1 = source_y0 + 1 < source->height ? source_y0 + 1 : source_y0;
+         u16 weight    = (fixed >> 8) & 0xFF;
+         u8* row0 = (u8*)source->pixels + source_y0 * source->pitch;
+         u8* row1 = (u8*)source->pixels + source_y1 * source->pitch;
+
+         __m128i weight0 = _mm_set1_epi16(256 - weight);
+         __m128i weight1 = _mm_set1_epi16(weight);
+         u32 x = 0;
+         for(; x + 4 <= source->width; x += 4) {
+            __m128i top    = _mm_loadu_si128((__m128i*)(row0 + x * BYTES_PER_PIXEL));
+            __m128i bottom = _mm_loadu_si128((__m128i*)(row1 + x * BYTES_PER_PIXEL));
+            __m128i low  = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(top, zero), weight0),
+                                         _mm_mullo_epi16(_mm_unpacklo_epi8(bottom, zero), weight1));
+            __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(top, zero), weight0),
+                                         _mm_mullo_epi16(_mm_unpackhi_epi8(bottom, zero), weight1));
+            _mm_storeu_si128((__m128i*)(scratch + x), _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+         }
+         for(; x < source->width; ++x) {
+            __m128i top    = _mm_unpacklo_epi8(_mm_cvtsi32_si128(((u32*)row0)[x]), zero);
+            __m128i bottom = _mm_unpacklo_epi8(_mm_cvtsi32_si128(((u32*)row1)[x]), zero);
+            __m128i blend  = _mm_add_epi16(_mm_mullo_epi16(top, weight0), _mm_mullo_epi16(bottom, weight1));
+            scratch[x] = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_srli_epi16(blend, 8), zero));
+         }
+         scratch[source->width] = scratch[source->width - 1];
+      }
+
+      u32* destination_row = (u32*)(destination + y * destination_pitch);
+      for(u32 x=0; x < width; ++x) {
+         u16 weight = weights[x];
+         __m128i pair    = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(scratch + columns[x])), zero);
+         __m128i blend   = _mm_mullo_epi16(pair, _mm_set_epi16(weight, weight, weight, weight,
+                                                               256 - weight, 256 - weight, 256 - weight, 256 - weight));
+         blend = _mm_srli_epi16(_mm_add_epi16(blend, _mm_srli_si128(blend, 8)), 8);
+         destination_row[x] = _mm_cvtsi128_si32(_mm_packus_epi16(blend, zero));
+      }
+   }
+}
+
+__attribute__((target("avx2"))) INTERNAL void
+stretch_bilinear_avx2(xxcb_render_buffer* source, u8* destination, u32 destination_pitch, u32 width, u32 height) {
+   u32*    columns = source->column_sources;
+   u16*    weights = source->column_weights;
+   u32*    scratch = source->row_scratch;
+   __m256i zero    = _mm256_setzero_si256();
+   u32     last_fixed = 0xFFFFFFFF;
+
+   for(u32 y=0; y < height; ++y) {
+      u32 fixed = stretch_source_fixed(y, source->height, height) & 0xFFFFFF00;
+      if(fixed != last_fixed) {
+         last_fixed = fixed;
+
+         u32 source_y0 = fixed >> 16;
+         u32 source_y1 = source_y0 + 1 < source->height ? source_y0 + 1 : source_y0;
+         u16 weight    = (fixed >> 8) & 0xFF;
+         u8* row0 = (u8*)source->pixels + source_y0 * source->pitch;
+         u8* row1 = (u8*)source->pixels + source_y1 * source->pitch;
+
+         __m256i weight0 = _mm256_set1_epi16(256 - weight);
+         __m256i weight1 = _mm256_set1_epi16(weight);
+         u32 x = 0;
+         for(; x + 8 <= source->width; x += 8) {
+            __m256i top    = _mm256_loadu_si256((__m256i*)(row0 + x * BYTES_PER_PIXEL));
+            __m256i bottom = _mm256_loadu_si256((__m256i*)(row1 + x * BYTES_PER_PIXEL));
+            __m256i low  = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(top, zero), weight0),
+                                            _mm256_mullo_epi16(_mm256_unpacklo_epi8(bottom, zero), weight1));
+            __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(top, zero), weight0),
+                                            _mm256_mullo_epi16(_mm256_unpackhi_epi8(bottom, zero), weight1));
+            _mm256_storeu_si256((__m256i*)(scratch + x), _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8)));
+         }
+         for(; x < source->width; ++x) {
+            __m128i top    = _mm_unpacklo_epi8(_mm_cvtsi32_si128(((u32*)row0)[x]), _mm_setzero_si128());
+            __m128i bottom = _mm_unpacklo_epi8(_mm_cvtsi32_si128(((u32*)row1)[x]), _mm_setzero_si128());
+            __m128i blend  = _mm_add_epi16(_mm_mullo_epi16(top, _mm256_castsi256_si128(weight0)),
+                                           _mm_mullo_epi16(bottom, _mm256_castsi256_si128(weight1)));
+            scratch[x] = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_srli_epi16(blend, 8), _mm_setzero_si128()));
+         }
+         scratch[source->width] = scratch[source->width - 1];
+      }
+
+      //Note(LAG): Two destination pixels per iteration, one in each 128 bit lane
+      u32* destination_row = (u32*)(destination + y * destination_pitch);
+      u32 x = 0;
+      for(; x + 2 <= width; x += 2) {
+         u16 weight_a = weights[x];
+         u16 weight_b = weights[x + 1];
+         __m128i pairs = _mm_set_epi64x(*(s64*)(scratch + columns[x + 1]), *(s64*)(scratch + columns[x]));
+         __m256i blend = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(pairs),
+                                            _mm256_set_epi16(weight_b, weight_b, weight_b, weight_b,
+                                                             256 - weight_b, 256 - weight_b, 256 - weight_b, 256 - weight_b,
+                                                             weight_a, weight_a, weight_a, weight_a,
+                                                             256 - weight_a, 256 - weight_a, 256 - weight_a, 256 - weight_a));
+         blend = _mm256_srli_epi16(_mm256_add_epi16(blend, _mm256_srli_si256(blend, 8)), 8);
+         blend = _mm256_packus_epi16(blend, zero);
+         destination_row[x]     = _mm_cvtsi128_si32(_mm256_castsi256_si128(blend));
+         destination_row[x + 1] = _mm_cvtsi128_si32(_mm256_extracti128_si256(blend, 1));
+      }
+      for(; x < width; ++x) {
+         u16 weight = weights[x];
+         __m128i pair  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(scratch + columns[x])), _mm_setzero_si128());
+         __m128i blend = _mm_mullo_epi16(pair, _mm_set_epi16(weight, weight, weight, weight,
+                                                             256 - weight, 256 - weight, 256 - weight, 256 - weight));
+         blend = _mm_srli_epi16(_mm_add_epi16(blend, _mm_srli_si128(blend, 8)), 8);
+         destination_row[x] = _mm_cvtsi128_si32(_mm_packus_epi16(blend, _mm_setzero_si128()));
+      }
+   }
+}
+
+//Note(LAG): Stretches the fixed size render buffer over the whole backbuffer, or over the largest rectangle with the same
+//aspect ratio when letterboxing, with the bars cleared to black
+INTERNAL void
+stretch_destination_rect(u32 source_width, u32 source_height, u32 destination_width, u32 destination_height, bool32 letterbox,
+                         u32* offset_x, u32* offset_y, u32* width, u32* height) {
+   *width  = destination_width;
+   *height = destination_height;
+   if(letterbox) {
+      if(destination_width * source_height > destination_height * source_width) {
+         *width = (destination_height * source_width) / source_height;
+      } else {
+         *height = (destination_width * source_height) / source_width;
+      }
+   }
+   *offset_x = (destination_width - *width) / 2;
+   *offset_y = (destination_height - *height) / 2;
+}
+
+INTERNAL void
+stretch_blit(xxcb_render_buffer* source, xxcb_offscreen_buffer* destination) {
+   u32 width;
+   u32 height;
+   u32 offset_x;
+   u32 offset_y;
+   stretch_destination_rect(source->width, source->height, destination->width, destination->height, source->letterbox,
+                            &offset_x, &offset_y, &width, &height);
+
+   if(source->letterbox) {
+      u8* row = (u8*)destination->pixels;
+      for(u32 y=0; y < destination->height; ++y) {
+         if(y < offset_y || y >= offset_y + height) {
+            memset(row, 0, destination->width * BYTES_PER_PIXEL);
+         } else {
+            memset(row, 0, offset_x * BYTES_PER_PIXEL);
+            memset(row + (offset_x + width) * BYTES_PER_PIXEL, 0, (destination->width - offset_x - width) * BYTES_PER_PIXEL);
+         }
+         row += destination->pitch;
+      }
+   }
+
+   if(width == 0 || height == 0) {
+      return;
+   }
+
+   stretch_build_columns(source, width);
+   u8* target = (u8*)destination->pixels + offset_y * destination->pitch + offset_x * BYTES_PER_PIXEL;
+   if(source->filter == STRETCH_FILTER_NEAREST) {
+      stretch_nearest(source, target, destination->pitch, width, height);
+   } else {
+      stretch_bilinear(source, target, destination->pitch, width, height);
+   }
+}
+
+INTERNAL void
+unflushed_update_window(xxcb_offscreen_buffer* buffer, u16 width, u16 height) {
+   if(buffer->shm_segment) {
+      //Note(LAG): Drawn straight from the segment, the completion event tells when the server is done reading it
+      //and only then the buffer can be handed back to the game. Marked before the request goes out, the event thread
+      //may read the completion before this function returns
+      __atomic_store_n(&buffer->is_busy, TRUE, __ATOMIC_RELEASE);
+      xcb_shm_put_image(_connection,
+                        _window,
+                        _gcontext,
+                        buffer->width, buffer->height,
+                        0, 0,
+                        width, height,
+                        0, 0,
+                        _screen->root_depth,
+                        XCB_IMAGE_FORMAT_Z_PIXMAP,
+                        1,
+                        buffer->shm_segment, 0);
+   } else {
+      unflushed_upload_dirty_tiles(buffer);
+      xcb_copy_area(_connection, buffer->pixmap, _window, _gcontext, 0, 0, 0, 0, width, height);
+   }
+}
+
+INTERNAL xcb_render_pictformat_t
+xrender_find_visual_format(xcb_render_query_pict_formats_reply_t* _formats_reply, xcb_visualid_t visual) {
+   xcb_render_pictscreen_iterator_t _screen_iterator = xcb_render_query_pict_formats_screens_iterator(_formats_reply);
+   for(; _screen_iterator.rem; xcb_render_pictscreen_next(&_screen_iterator)) {
+      xcb_render_pictdepth_iterator_t _depth_iterator = xcb_render_pictscreen_depths_iterator(_screen_iterator.data);
+      for(; _depth_iterator.rem; xcb_render_pictdepth_next(&_depth_iterator)) {
+         xcb_render_pictvisual_iterator_t _visual_iterator = xcb_render_pictdepth_visuals_iterator(_depth_iterator.data);
+         for(; _visual_iterator.rem; xcb_render_pictvisual_next(&_visual_iterator)) {
+            if(_visual_iterator.data->visual == visual) {
+               return _visual_iterator.data->format;
+            }
+         }
+      }
+   }
+   return XCB_NONE;
+}
+
+//Note(LAG): The server scales the fixed size frame to the window, the backbuffers stay at the render size so only those
+//pixels are ever handed to the server and the main thread does no stretching at all
+INTERNAL bool32
+xrender_init(u16 width, u16 height, stretch_filter filter, bool32 letterbox) {
+   const xcb_query_extension_reply_t* _extension = xcb_get_extension_data(_connection, &xcb_render_id);
+   if(!_extension || !_extension->present) {
+      return FALSE;
+   }
+
+   xcb_render_query_version_reply_t* _version_reply = xcb_render_query_version_reply(_connection,
+                                                                                     xcb_render_query_version(_connection,
+                                                                                                              XCB_RENDER_MAJOR_VERSION,
+                                                                                                              XCB_RENDER_MINOR_VERSION),
+                                                                                     0);
+   if(!_version_reply) {
+      return FALSE;
+   }
+   //Note(LAG): Transforms and filters came with RENDER 0.6
+   bool32 has_transforms = _version_reply->major_version > 0 || _version_reply->minor_version >= 6;
+   free(_version_reply);
+   if(!has_transforms) {
+      return FALSE;
+   }
+
+   xcb_render_query_pict_formats_reply_t* _formats_reply = xcb_render_query_pict_formats_reply(_connection,
+                                                                                               xcb_render_query_pict_formats(_connection),
+                                                                                               0);
+   if(!_formats_reply) {
+      return FALSE;
+   }
+   xcb_render_pictformat_t _format = xrender_find_visual_format(_formats_reply, _screen->root_visual);
+   free(_formats_reply);
+   if(_format == XCB_NONE) {
+      return FALSE;
+   }
+
+   for(u32 buffer_index=0; buffer_index < global_backbuffer_count; ++buffer_index) {
+      unflushed_resize_backbuffer(&global_backbuffers[buffer_index], width, height);
+   }
+   if(_pixel_format.convert) {
+      resize_canonical_buffer(&global_canonical_buffer, width, height);
+   }
+
+   //Note(LAG): With SHM the frame is copied into a plain server pixmap so the completion event can release the buffer,
+   //the fallback already uploads into the pixmap of its only buffer
+   if(_shm_available) {
+      _xrender_source_pixmap = xcb_generate_id(_connection);
+      xcb_create_pixmap(_connection, _screen->root_depth, _xrender_source_pixmap, _window, width, height);
+   } else {
+      _xrender_source_pixmap = global_backbuffers[0].pixmap;
+   }
+
+   _xrender_source_picture = xcb_generate_id(_connection);
+   xcb_render_create_picture(_connection, _xrender_source_picture, _xrender_source_pixmap, _format, 0, 0);
+   _xrender_window_picture = xcb_generate_id(_connection);
+   xcb_render_create_picture(_connection, _xrender_window_picture, _window, _format, 0, 0);
+
+   char* filter_name = filter == STRETCH_FILTER_NEAREST ? "nearest" : "bilinear";
+   xcb_render_set_picture_filter(_connection, _xrender_source_picture, strlen(filter_name), filter_name, 0, 0);
+   _xrender_letterbox = letterbox;
+
+   return TRUE;
+}
+
+INTERNAL void
+unflushed_xrender_update_window(xxcb_offscreen_buffer* buffer, u16 window_width, u16 window_height) {
+   if(buffer->shm_segment) {
+      __atomic_store_n(&buffer->is_busy, TRUE, __ATOMIC_RELEASE);
+      xcb_shm_put_image(_connection,
+                        _xrender_source_pixmap,
+                        _gcontext,
+                        buffer->width, buffer->height,
+                        0, 0,
+                        buffer->width, buffer->height,
+                        0, 0,
+                        _screen->root_depth,
+                        XCB_IMAGE_FORMAT_Z_PIXMAP,
+                        1,
+                        buffer->shm_segment, 0);
+   } else {
+      unflushed_upload_dirty_tiles(buffer);
+   }
+
+   u32 width;
+   u32 height;
+   u32 offset_x;
+   u32 offset_y;
+   stretch_destination_rect(buffer->width, buffer->height, window_width, window_height, _xrender_letterbox,
+                            &offset_x, &offset_y, &width, &height);
+   if(width == 0 || height == 0) {
+      return;
+   }
+
+   //Note(LAG): The transform maps window pixels back to source pixels, so it is the source size over the window size
+   xcb_render_transform_t transform = {};
+   transform.matrix11 = ((s64)buffer->width << 16) / width;
+   transform.matrix22 = ((s64)buffer->height << 16) / height;
+   transform.matrix33 = 1 << 16;
+   if(transform.matrix11 != _xrender_transform.matrix11 || transform.matrix22 != _xrender_transform.matrix22) {
+      xcb_render_set_picture_transform(_connection, _xrender_source_picture, transform);
+      _xrender_transform = transform;
+   }
+
+   if(offset_x || offset_y) {
+      xcb_rectangle_t bars[] = {
+         {0, 0, window_width, offset_y},
+         {0, offset_y + height, window_width, window_height - offset_y - height},
+         {0, offset_y, offset_x, height},
+         {offset_x + width, offset_y, window_width - offset_x - width, height},
+      };
+      xcb_render_color_t black = {0, 0, 0, 0xFFFF};
+      xcb_render_fill_rectangles(_connection, XCB_RENDER_PICT_OP_SRC, _xrender_window_picture, black, ARRAY_COUNT(bars), bars);
+   }
+
+   xcb_render_composite(_connection,
+                        XCB_RENDER_PICT_OP_SRC,
+                        _xrender_source_picture, XCB_NONE, _xrender_window_picture,
+                        0, 0,
+                        0, 0,
+                        offset_x, offset_y,
+                        width, height);
+}
+
+//Note(LAG): Repaints part of the window from what the server already holds, the last frame stays in the source pixmap
+//until the next one is uploaded so nothing has to be drawn or sent again
+INTERNAL void
+unflushed_xrender_expose_window(xxcb_offscreen_buffer* buffer,
+                                s16 x, s16 y, u16 expose_width, u16 expose_height,
+                                u16 window_width, u16 window_height) {
+   u32 width;
+   u32 height;
+   u32 offset_x;
+   u32 offset_y;
+   stretch_destination_rect(buffer->width, buffer->height, window_width, window_height, _xrender_letterbox,
+                            &offset_x, &offset_y, &width, &height);
+   if(width == 0 || height == 0) {
+      return;
+   }
+
+   if(offset_x || offset_y) {
+      xcb_rectangle_t bars[] = {
+         {0, 0, window_width, offset_y},
+         {0, offset_y + height, window_width, window_height - offset_y - height},
+         {0, offset_y, offset_x, height},
+         {offset_x + width, offset_y, window_width - offset_x - width, height},
+      };
+      xcb_render_color_t black = {0, 0, 0, 0xFFFF};
+      xcb_render_fill_rectangles(_connection, XCB_RENDER_PICT_OP_SRC, _xrender_window_picture, black, ARRAY_COUNT(bars), bars);
+   }
+
+   s32 min_x = x > (s32)offset_x ? x : (s32)offset_x;
+   s32 min_y = y > (s32)offset_y ? y : (s32)offset_y;
+   s32 max_x = x + expose_width  < (s32)(offset_x + width)  ? x + expose_width  : (s32)(offset_x + width);
+   s32 max_y = y + expose_height < (s32)(offset_y + height) ? y + expose_height : (s32)(offset_y + height);
+   if(min_x >= max_x || min_y >= max_y) {
+      return;
+   }
+
+   //Note(LAG): The source offset is in window space too, the picture transform takes it back to source pixels
+   xcb_render_composite(_connection,
+                        XCB_RENDER_PICT_OP_SRC,
+                        _xrender_source_picture, XCB_NONE, _xrender_window_picture,
+                        min_x - offset_x, min_y - offset_y,
+                        0, 0,
+                        min_x, min_y,
+                        max_x - min_x, max_y - min_y);
+}
+
+INTERNAL bool32
+present_query_support(void) {
+   const xcb_query_extension_reply_t* _extension = xcb_get_extension_data(_connection, &xcb_present_id);
+   if(!_extension || !_extension->present) {
+      return FALSE;
+   }
+
+   xcb_present_query_version_reply_t* _version_reply = xcb_present_query_version_reply(_connection,
+                                                                                       xcb_present_query_version(_connection,
+                                                                                                                 XCB_PRESENT_MAJOR_VERSION,
+                                                                                                                 XCB_PRESENT_MINOR_VERSION),
+                                                                                       0);
+   if(!_version_reply) {
+      return FALSE;
+   }
+   free(_version_reply);
+   return TRUE;
+}
+
+//Note(LAG): The pixmap is queued for the vblank refreshes_per_frame after the last one that completed, the server holds it
+//until the idle event, which is what releases the buffer back to the game in this path
+INTERNAL void
+unflushed_present_window(xxcb_offscreen_buffer* buffer, u32 refreshes_per_frame) {
+   u64 target_msc = _present_timing.msc ? _present_timing.msc + refreshes_per_frame : 0;
+
+   __atomic_store_n(&buffer->is_busy, TRUE, __ATOMIC_RELEASE);
+   buffer->presented_pixmap = buffer->pixmap;
+   xcb_present_pixmap(_connection,
+                      _window,
+                      buffer->pixmap,
+                      ++_present_timing.serial,
+                      XCB_NONE, XCB_NONE,
+                      0, 0,
+                      XCB_NONE,
+                      XCB_NONE, XCB_NONE,
+                      XCB_PRESENT_OPTION_NONE,
+                      target_msc, 0, 0,
+                      0, 0);
+}
+
+INTERNAL void
+present_process_event(xcb_generic_event_t* _event) {
+   xcb_present_generic_event_t* _present_event = (xcb_present_generic_event_t*)_event;
+   switch(_present_event->evtype) {
+      case XCB_PRESENT_EVENT_COMPLETE_NOTIFY:
+      {
+         xcb_present_complete_notify_event_t* _complete_event = (xcb_present_complete_notify_event_t*)_event;
+         if(_complete_event->kind != XCB_PRESENT_COMPLETE_KIND_PIXMAP) {
+            break;
+         }
+
+         //Note(LAG): UST is in microseconds, the refresh period comes from how far it moved between the two last completed MSCs
+         if(_present_timing.msc && _complete_event->msc > _present_timing.msc && _complete_event->ust > _present_timing.ust) {
+            _present_timing.seconds_per_refresh = (f32)(_complete_event->ust - _present_timing.ust) /
+                                                  ((f32)(_complete_event->msc - _present_timing.msc) * 1000.0f * 1000.0f);
+         }
+         _present_timing.msc = _complete_event->msc;
+         _present_timing.ust = _complete_event->ust;
+         _present_timing.completed_serial = _complete_event->serial;
+      } break;
+      case XCB_PRESENT_EVENT_IDLE_NOTIFY:
+      {
+         xcb_present_idle_notify_event_t* _idle_event = (xcb_present_idle_notify_event_t*)_event;
+         for(u32 buffer_index=0; buffer_index < global_backbuffer_count; ++buffer_index) {
+            //Note(LAG): Matched against the pixmap that was presented, a resize may have replaced it while it was in flight
+            if(global_backbuffers[buffer_index].presented_pixmap == _idle_event->pixmap) {
+               __atomic_store_n(&global_backbuffers[buffer_index].is_busy, FALSE, __ATOMIC_RELEASE);
+            }
+         }
+      } break;
+   }
+   free(_event);
+}
+
+//Note(LAG): Blocks until the last presented frame hits the screen, this replaces the sleep and spin when Present is in use
+INTERNAL void
+present_wait_for_complete(void) {
+   while((s32)(_present_timing.serial - _present_timing.completed_serial) > 0) {
+      xcb_generic_event_t* _event = COUNTED_SYSCALL(xcb_wait_for_special_event(_connection, _present_special_event));
+      if(!_event) {
+         is_running = 0;
+         break;
+      }
+      present_process_event(_event);
+   }
+}
+
+INTERNAL bool32
+randr_query_support(void) {
+   const xcb_query_extension_reply_t* _extension_reply = xcb_get_extension_data(_connection, &xcb_randr_id);
+   if(!_extension_reply || !_extension_reply->present) {
+      return FALSE;
+   }
+
+   //Note(LAG): GetScreenResourcesCurrent is 1.3, older servers would need the slow probing GetScreenResources
+   xcb_randr_query_version_reply_t* _version_reply = xcb_randr_query_version_reply(_connection,
+                                                                                   xcb_randr_query_version(_connection,
+                                                                                                           XCB_RANDR_MAJOR_VERSION,
+                                                                                                           XCB_RANDR_MINOR_VERSION),
+                                                                                   0);
+   if(!_version_reply) {
+      return FALSE;
+   }
+   bool32 is_supported = _version_reply->major_version > 1 ||
+                         (_version_reply->major_version == 1 && _version_reply->minor_version >= 3);
+   free(_version_reply);
+
+   _randr_first_event = _extension_reply->first_event;
+   return is_supported;
+}
+
+//Note(LAG): Where the window's origin is on the root, one round trip
+INTERNAL void
+window_root_position(s16* x, s16* y) {
+   xcb_translate_coordinates_cookie_t _translate_cookie = xcb_translate_coordinates(_connection, _window, _screen->root, 0, 0);
+   xcb_translate_coordinates_reply_t* _translate_reply =
+      COUNTED_ROUND_TRIP(xcb_translate_coordinates_reply(_connection, _translate_cookie, 0));
+   if(_translate_reply) {
+      *x = _translate_reply->dst_x;
+      *y = _translate_reply->dst_y;
+      free(_translate_reply);
+   }
+}
+
+//Note(LAG): Only asked again when RandR reports a change, which CRTC the window is on is then worked out locally
+INTERNAL void
+randr_query_crtcs(xxcb_crtc_layout* layout) {
+   layout->count = 0;
+   xcb_randr_get_screen_resources_current_cookie_t _resources_cookie = xcb_randr_get_screen_resources_current(_connection,
+                                                                                                             _window);
+   xcb_randr_get_screen_resources_current_reply_t* _resources_reply =
+      COUNTED_ROUND_TRIP(xcb_randr_get_screen_resources_current_reply(_connection, _resources_cookie, 0));
+   if(!_resources_reply) {
+      return;
+   }
+
+   //Note(LAG): All the CRTC queries go out before the first reply is read, one round trip instead of one per CRTC
+   xcb_randr_crtc_t* _crtcs = xcb_randr_get_screen_resources_current_crtcs(_resources_reply);
+   int crtc_count = xcb_randr_get_screen_resources_current_crtcs_length(_resources_reply);
+   if(crtc_count > RANDR_CRTC_COUNT) {
+      crtc_count = RANDR_CRTC_COUNT;
+   }
+   xcb_randr_get_crtc_info_cookie_t _crtc_cookies[crtc_count];
+   for(int crtc_index=0; crtc_index < crtc_count; ++crtc_index) {
+      _crtc_cookies[crtc_index] = xcb_randr_get_crtc_info(_connection, _crtcs[crtc_index], _resources_reply->config_timestamp);
+   }
+
+   xcb_randr_mode_info_t* _modes = xcb_randr_get_screen_resources_current_modes(_resources_reply);
+   int mode_count = xcb_randr_get_screen_resources_current_modes_length(_resources_reply);
+   for(int crtc_index=0; crtc_index < crtc_count; ++crtc_index) {
+      xcb_randr_get_crtc_info_reply_t* _crtc_reply =
+         COUNTED_ROUND_TRIP(xcb_randr_get_crtc_info_reply(_connection, _crtc_cookies[crtc_index], 0));
+      if(!_crtc_reply) {
+         continue;
+      }
+      if(_crtc_reply->mode == XCB_NONE) {
+         free(_crtc_reply);
+         continue;
+      }
+
+      xxcb_crtc* crtc = &layout->crtcs[layout->count++];
+      crtc->x          = _crtc_reply->x;
+      crtc->y          = _crtc_reply->y;
+      crtc->width      = _crtc_reply->width;
+      crtc->height     = _crtc_reply->height;
+      crtc->refresh_hz = 0.0f;
+      for(int mode_index=0; mode_index < mode_count; ++mode_index) {
+         xcb_randr_mode_info_t* _mode_info = &_modes[mode_index];
+         if(_mode_info->id != _crtc_reply->mode || !_mode_info->htotal || !_mode_info->vtotal) {
+            continue;
+         }
+         f32 vtotal = (f32)_mode_info->vtotal;
+         if(_mode_info->mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN) {
+            vtotal *= 2.0f;
+         }
+         if(_mode_info->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE) {
+            vtotal /= 2.0f;
+         }
+         crtc->refresh_hz = (f32)_mode_info->dot_clock / ((f32)_mode_info->htotal * vtotal);
+         break;
+      }
+      free(_crtc_reply);
+   }
+   free(_resources_reply);
+}
+
+//Note(LAG): The CRTC that holds the point, -1 when it is off every CRTC
+INTERNAL s32
+crtc_layout_find(xxcb_crtc_layout* layout, s32 x, s32 y) {
+   for(u32 crtc_index=0; crtc_index < layout->count; ++crtc_index) {
+      xxcb_crtc* crtc = &layout->crtcs[crtc_index];
+      if(x >= crtc->x && x < crtc->x + crtc->width && y >= crtc->y && y < crtc->y + crtc->height) {
+         return crtc_index;
+      }
+   }
+   return -1;
+}
+
+//Note(LAG): The buffer handed out last is the one on screen until the game draws into the next, its pixmap still has
+//the frame whoever showed it (SHM, Present or a copy), so an expose is one copy of the damaged rectangle
+INTERNAL void
+unflushed_expose_window(xxcb_offscreen_buffer* buffer,
+                        s16 x, s16 y, u16 width, u16 height,
+                        u16 window_width, u16 window_height) {
+   if(!buffer) {
+      return;
+   }
+   if(_xrender_available) {
+      unflushed_xrender_expose_window(buffer, x, y, width, height, window_width, window_height);
+   } else if(buffer->pixmap) {
+      xcb_copy_area(_connection, buffer->pixmap, _window, _gcontext, x, y, x, y, width, height);
+   }
+}
+
+INTERNAL void
+shm_process_completion(xcb_shm_completion_event_t* _completion_event) {
+   for(u32 buffer_index=0; buffer_index < global_backbuffer_count; ++buffer_index) {
+      xxcb_offscreen_buffer* buffer = &global_backbuffers[buffer_index];
+      if(__atomic_load_n(&buffer->shm_segment, __ATOMIC_ACQUIRE) == _completion_event->shmseg) {
+         __atomic_store_n(&buffer->is_busy, FALSE, __ATOMIC_RELEASE);
+      }
+   }
+   if(_event_thread.is_running) {
+      sem_post(&_event_thread.buffer_released);
+   }
+}
+
+//Note(LAG): Completions are handled right here, whichever thread reads them, everything else the loop cares about
+//becomes a record
+INTERNAL bool32
+event_translate(xcb_generic_event_t* _event, xxcb_event_record* record) {
+   u8 response_type = _event->response_type &~0x80;
+   switch(response_type) {
+      case XCB_CLIENT_MESSAGE:
+      {
+         xcb_client_message_event_t* _client_message = (xcb_client_message_event_t*)_event;
+         if(_client_message->data.data32[0] == _wm_delete_protocol) {
+            record->type = EVENT_RECORD_CLOSE;
+            return TRUE;
+         }
+      } break;
+      case XCB_CONFIGURE_NOTIFY:
+      {
+         xcb_configure_notify_event_t* _configure_notify_event = (xcb_configure_notify_event_t*)_event;
+         record->type   = EVENT_RECORD_CONFIGURE;
+         record->value  = (_event->response_type & 0x80) != 0;
+         record->x      = _configure_notify_event->x;
+         record->y      = _configure_notify_event->y;
+         record->width  = _configure_notify_event->width;
+         record->height = _configure_notify_event->height;
+         return TRUE;
+      } break;
+      case XCB_MAP_NOTIFY:
+      case XCB_UNMAP_NOTIFY:
+      {
+         record->type  = EVENT_RECORD_MAP;
+         record->value = response_type == XCB_MAP_NOTIFY;
+         return TRUE;
+      } break;
+      case XCB_VISIBILITY_NOTIFY:
+      {
+         xcb_visibility_notify_event_t* _visibility_event = (xcb_visibility_notify_event_t*)_event;
+         record->type  = EVENT_RECORD_VISIBILITY;
+         record->value = _visibility_event->state == XCB_VISIBILITY_FULLY_OBSCURED;
+         return TRUE;
+      } break;
+      case XCB_FOCUS_IN:
+      case XCB_FOCUS_OUT:
+      {
+         //Note(LAG): Keyboard grabs (alt-tab, WM key bindings) send focus pairs too, those do not change who has focus
+         xcb_focus_in_event_t* _focus_event = (xcb_focus_in_event_t*)_event;
+         if(_focus_event->mode != XCB_NOTIFY_MODE_GRAB && _focus_event->mode != XCB_NOTIFY_MODE_UNGRAB) {
+            record->type  = EVENT_RECORD_FOCUS;
+            record->value = response_type == XCB_FOCUS_IN;
+            return TRUE;
+         }
+      } break;
+      case XCB_EXPOSE:
+      {
+         xcb_expose_event_t* _expose_event = (xcb_expose_event_t*)_event;
+         record->type   = EVENT_RECORD_EXPOSE;
+         record->value  = _expose_event->count > 0xFF ? 0xFF : _expose_event->count;
+         record->x      = _expose_event->x;
+         record->y      = _expose_event->y;
+         record->width  = _expose_event->width;
+         record->height = _expose_event->height;
+         return TRUE;
+      } break;
+      case XCB_KEY_RELEASE:
+      case XCB_KEY_PRESS:
+      {
+         xcb_key_press_event_t* _key_event = (xcb_key_press_event_t*)_event;
+         record->type  = response_type == XCB_KEY_PRESS ? EVENT_RECORD_KEY_PRESS : EVENT_RECORD_KEY_RELEASE;
+         record->value = _key_event->detail;
+         return TRUE;
+      } break;
+      default:
+      {
+         if(response_type == _shm_completion_event && _shm_available) {
+            shm_process_completion((xcb_shm_completion_event_t*)_event);
+         } else if(_randr_available &&
+                   (response_type == _randr_first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+                    response_type == _randr_first_event + XCB_RANDR_NOTIFY)) {
+            record->type = EVENT_RECORD_REFRESH_CHANGE;
+            return TRUE;
+         }
+      } break;
+   }
+   return FALSE;
+}
+
+INTERNAL bool32
+event_ring_push(xxcb_event_ring* ring, xxcb_event_record* record) {
+   u32 write = __atomic_load_n(&ring->write, __ATOMIC_RELAXED);
+   u32 read  = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+   if(write - read == EVENT_RING_COUNT) {
+      return FALSE;
+   }
+   ring->records[write % EVENT_RING_COUNT] = *record;
+   __atomic_store_n(&ring->write, write + 1, __ATOMIC_RELEASE);
+   return TRUE;
+}
+
+INTERNAL bool32
+event_ring_pop(xxcb_event_ring* ring, xxcb_event_record* record) {
+   u32 read  = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+   u32 write = __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE);
+   if(read == write) {
+      return FALSE;
+   }
+   *record = ring->records[read % EVENT_RING_COUNT];
+   __atomic_store_n(&ring->read, read + 1, __ATOMIC_RELEASE);
+   return TRUE;
+}
+
+INTERNAL void*
+event_thread_proc(void* parameter) {
+   xxcb_event_thread* event_thread = (xxcb_event_thread*)parameter;
+   for(;;) {
+      xxcb_event_record record = {};
+      xcb_generic_event_t* _event = xcb_wait_for_event(_connection);
+      if(!_event) {
+         //Note(LAG): The connection is gone, the loop gets a close so it does not wait on a thread that stopped reading
+         record.type = EVENT_RECORD_CLOSE;
+         event_ring_push(&event_thread->ring, &record);
+         sem_post(&event_thread->buffer_released);
+         eventfd_write(event_thread->wake_descriptor, 1);
+         break;
+      }
+
+      bool32 has_record = event_translate(_event, &record);
+      free(_event);
+      if(!__atomic_load_n(&event_thread->is_running, __ATOMIC_ACQUIRE)) {
+         break;
+      }
+
+      if(has_record) {
+         //Note(LAG): A full ring means the loop is stuck on something, waiting keeps every key edge
+         while(!event_ring_push(&event_thread->ring, &record)) {
+            usleep(1000);
+         }
+         eventfd_write(event_thread->wake_descriptor, 1);
+      }
+   }
+   return 0;
+}
+
+INTERNAL bool32
+event_thread_start(xxcb_event_thread* event_thread) {
+   event_thread->wake_descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if(event_thread->wake_descriptor < 0) {
+      return FALSE;
+   }
+   sem_init(&event_thread->buffer_released, 0, 0);
+   event_thread->is_running = TRUE;
+   if(pthread_create(&event_thread->thread, 0, event_thread_proc, event_thread) != 0) {
+      event_thread->is_running = FALSE;
+      close(event_thread->wake_descriptor);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+//Note(LAG): The thread is parked in xcb_wait_for_event, an event sent to our own window is what gets it to look at the flag
+INTERNAL void
+event_thread_stop(xxcb_event_thread* event_thread) {
+   __atomic_store_n(&event_thread->is_running, FALSE, __ATOMIC_RELEASE);
+
+   xcb_client_message_event_t _wake_event = {};
+   _wake_event.response_type = XCB_CLIENT_MESSAGE;
+   _wake_event.format        = 32;
+   _wake_event.window        = _window;
+   _wake_event.type          = _wm_protocols;
+   xcb_send_event(_connection, 0, _window, XCB_EVENT_MASK_NO_EVENT, (char*)&_wake_event);
+   xcb_flush(_connection);
+
+   pthread_join(event_thread->thread, 0);
+   close(event_thread->wake_descriptor);
+}
+
+//Note(LAG): The socket is only read when the reactor saw it become readable, replies waited on earlier may still have
+//queued events without a new edge, so the queue is always drained
+INTERNAL xcb_generic_event_t*
+poll_next_event(bool32 is_readable) {
+   if(_deferred_event_read != _deferred_event_write) {
+      return _deferred_events[_deferred_event_read++ % DEFERRED_EVENT_COUNT];
+   }
+   return is_readable ? COUNTED_SYSCALL(xcb_poll_for_event(_connection)) : xcb_poll_for_queued_event(_connection);
+}
+
+INTERNAL bool32
+next_event_record(bool32 is_readable, xxcb_event_record* record) {
+   //Note(LAG): The eventfd is reset once the ring looks empty and the ring is looked at again after, a record pushed in
+   //between is either seen now or leaves the eventfd readable for the next wait
+   if(_event_thread.is_running) {
+      if(event_ring_pop(&_event_thread.ring, record)) {
+         return TRUE;
+      }
+      eventfd_t wake_count;
+      if(COUNTED_SYSCALL(eventfd_read(_event_thread.wake_descriptor, &wake_count)) != 0) {
+         return FALSE;
+      }
+      return event_ring_pop(&_event_thread.ring, record);
+   }
+
+   xcb_generic_event_t* _event;
+   while((_event = poll_next_event(is_readable))) {
+      bool32 has_record = event_translate(_event, record);
+      free(_event);
+      if(has_record) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+//Note(LAG): Hands out the next backbuffer the server is not reading from, in the rare case all of them are in flight it blocks
+//until a completion arrives, anything else read meanwhile is deferred to the next poll_next_event
+INTERNAL xxcb_offscreen_buffer*
+acquire_backbuffer(xxcb_offscreen_buffer* last_buffer) {
+   u32 last_index = last_buffer ? (u32)(last_buffer - global_backbuffers) : global_backbuffer_count - 1;
+
+   for(;;) {
+      for(u32 offset=1; offset <= global_backbuffer_count; ++offset) {
+         xxcb_offscreen_buffer* buffer = &global_backbuffers[(last_index + offset) % global_backbuffer_count];
+         if(!__atomic_load_n(&buffer->is_busy, __ATOMIC_ACQUIRE)) {
+            return buffer;
+         }
+      }
+
+      if(_deferred_event_write - _deferred_event_read == DEFERRED_EVENT_COUNT) {
+         //TODO(LAG): Diagnostic, the server stopped answering, reuse the buffer and risk the tear instead of losing input
+         break;
+      }
+
+      COUNTED_SYSCALL(xcb_flush(_connection));
+      if(_present_available) {
+         xcb_generic_event_t* _event = COUNTED_SYSCALL(xcb_wait_for_special_event(_connection, _present_special_event));
+         if(!_event) {
+            is_running = 0;
+            break;
+         }
+         present_process_event(_event);
+         continue;
+      }
+
+      if(_event_thread.is_running) {
+         COUNTED_SYSCALL(sem_wait(&_event_thread.buffer_released));
+         continue;
+      }
+
+      xcb_generic_event_t* _event = COUNTED_SYSCALL(xcb_wait_for_event(_connection));
+      if(!_event) {
+         is_running = 0;
+         break;
+      }
+
+      if((_event->response_type &~0x80) == _shm_completion_event) {
+         shm_process_completion((xcb_shm_completion_event_t*)_event);
+         free(_event);
+      } else {
+         _deferred_events[_deferred_event_write++ % DEFERRED_EVENT_COUNT] = _event;
+      }
+   }
+
+   return &global_backbuffers[(last_index + 1) % global_backbuffer_count];
+}
+
+INTERNAL void
+joystick_input_process(game_button_state* old_state, game_button_state* new_state, s16 value) {
+   new_state->ended_down = value;
+   new_state->half_transition_count = (old_state->ended_down != new_state->ended_down) ? 1 : 0;
+}
+
+INTERNAL f32
+joystick_axis_process(s16 value) {
+   s16 dead_zone = 7849;
+   f32 axis_limit = 32767.0f;
+   if(abs(value) < dead_zone) {
+      return 0;
+   } else if(value < -dead_zone) {
+      return (f32)((value + dead_zone) / (axis_limit - dead_zone));
+   }
+   return (f32)((value - dead_zone) / (axis_limit - dead_zone));
+}
+
+INTERNAL void
+keyboard_input_process(game_button_state* new_state, bool32 is_down) {
+   new_state->ended_down = is_down;
+   ++new_state->half_transition_count;
+}
+
+INTERNAL struct timeval
+get_timeval(void) {
+   struct timeval tv;
+   COUNTED_SYSCALL(gettimeofday(&tv, 0));
+   return tv;
+}
+
+INTERNAL f32
+get_seconds_elapsed(struct timeval tv_start, struct timeval tv_end) {
+   return (f32)(((tv_end.tv_sec * 1000000) + tv_end.tv_usec) - ((tv_start.tv_sec * 1000000) + tv_start.tv_usec)) / (1000.0f*1000.0f);
+}
+
+//Note(LAG): One epoll set for every descriptor the loop waits on. The X connection and the joystick are edge triggered
+//and read until they would block when their bit is set. The PCM descriptors are one shot because ALSA only knows what
+//they mean through snd_pcm_poll_descriptors_revents, they are armed again once the sound has been written
+INTERNAL void
+reactor_init(xxcb_reactor* reactor, int x_descriptor, int joystick_descriptor, bool32 watch_pcm) {
+   //Note(LAG): Until the first wait every source counts as ready, which is also what happens when epoll is missing
+   reactor->ready = REACTOR_SOURCE_X | REACTOR_SOURCE_JOYSTICK | REACTOR_SOURCE_SOUND;
+
+   reactor->epoll_descriptor = epoll_create1(EPOLL_CLOEXEC);
+   reactor->timer_descriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if(reactor->epoll_descriptor < 0 || reactor->timer_descriptor < 0) {
+      reactor->epoll_descriptor = -1;
+      return;
+   }
+
+   struct epoll_event _event = {};
+   _event.events   = EPOLLIN | EPOLLET;
+   _event.data.u32 = REACTOR_SOURCE_X;
+   epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_ADD, x_descriptor, &_event);
+   if(joystick_descriptor >= 0) {
+      _event.data.u32 = REACTOR_SOURCE_JOYSTICK;
+      epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_ADD, joystick_descriptor, &_event);
+   }
+   _event.events   = EPOLLIN;
+   _event.data.u32 = REACTOR_SOURCE_TIMER;
+   epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_ADD, reactor->timer_descriptor, &_event);
+
+   int pcm_descriptor_count = watch_pcm ? snd_pcm_poll_descriptors(_pcm, reactor->pcm_descriptors, REACTOR_PCM_DESCRIPTOR_COUNT) : 0;
+   reactor->pcm_descriptor_count = pcm_descriptor_count > 0 ? pcm_descriptor_count : 0;
+   for(u32 descriptor_index=0; descriptor_index < reactor->pcm_descriptor_count; ++descriptor_index) {
+      _event.events   = reactor->pcm_descriptors[descriptor_index].events | EPOLLONESHOT;
+      _event.data.u32 = REACTOR_SOURCE_SOUND | (descriptor_index << 16);
+      epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_ADD, reactor->pcm_descriptors[descriptor_index].fd, &_event);
+   }
+}
+
+INTERNAL void
+reactor_wait(xxcb_reactor* reactor, int timeout_ms) {
+   if(reactor->epoll_descriptor < 0) {
+      if(timeout_ms > 0) {
+         COUNTED_SYSCALL(usleep(timeout_ms * 1000));
+      }
+      return;
+   }
+
+   struct epoll_event _events[REACTOR_EVENT_COUNT];
+   int event_count = COUNTED_SYSCALL(epoll_wait(reactor->epoll_descriptor, _events, REACTOR_EVENT_COUNT, timeout_ms));
+   for(int event_index=0; event_index < event_count; ++event_index) {
+      u32 source = _events[event_index].data.u32 & 0xFFFF;
+      if(source == REACTOR_SOURCE_SOUND) {
+         reactor->pcm_descriptors[_events[event_index].data.u32 >> 16].revents = _events[event_index].events;
+      } else if(source == REACTOR_SOURCE_TIMER) {
+         u64 expirations;
+         COUNTED_SYSCALL(read(reactor->timer_descriptor, &expirations, sizeof(expirations)));
+      }
+      reactor->ready |= source;
+   }
+   reactor->has_waited = TRUE;
+}
+
+//Note(LAG): Replaces the usleep before the spin, it returns when the timer expires and collects whatever else became
+//ready in the meantime, so the next frame does not need to ask again
+INTERNAL void
+reactor_wait_for_timer(xxcb_reactor* reactor, s32 timeout_usecs) {
+   if(reactor->epoll_descriptor < 0) {
+      COUNTED_SYSCALL(usleep(timeout_usecs));
+      return;
+   }
+
+   struct itimerspec timer = {};
+   timer.it_value.tv_sec  = timeout_usecs / (1000 * 1000);
+   timer.it_value.tv_nsec = (timeout_usecs % (1000 * 1000)) * 1000;
+   COUNTED_SYSCALL(timerfd_settime(reactor->timer_descriptor, 0, &timer, 0));
+   while(!(reactor->ready & REACTOR_SOURCE_TIMER)) {
+      reactor_wait(reactor, -1);
+   }
+   reactor->ready &= ~REACTOR_SOURCE_TIMER;
+}
+
+//Note(LAG): Hands out what became ready since the last frame, asking the kernel without blocking only when no wait
+//has done it already
+INTERNAL u32
+reactor_begin_frame(xxcb_reactor* reactor) {
+   if(!reactor->has_waited) {
+      reactor_wait(reactor, 0);
+   }
+   u32 ready = reactor->ready;
+   if(reactor->epoll_descriptor >= 0) {
+      reactor->ready = 0;
+   }
+   reactor->has_waited = FALSE;
+   return ready;
+}
+
+INTERNAL bool32
+reactor_sound_is_ready(xxcb_reactor* reactor, u32 ready) {
+   if(reactor->epoll_descriptor < 0 || !reactor->pcm_descriptor_count) {
+      return TRUE;
+   }
+   if(!(ready & REACTOR_SOURCE_SOUND)) {
+      return FALSE;
+   }
+
+   //Note(LAG): An error (an underrun) also counts, the write is what recovers from it
+   unsigned short revents = 0;
+   COUNTED_SYSCALL(snd_pcm_poll_descriptors_revents(_pcm, reactor->pcm_descriptors, reactor->pcm_descriptor_count, &revents));
+   return (revents & (POLLOUT | POLLERR)) != 0;
+}
+
+INTERNAL void
+reactor_rearm_sound(xxcb_reactor* reactor) {
+   if(reactor->epoll_descriptor < 0) {
+      return;
+   }
+   for(u32 descriptor_index=0; descriptor_index < reactor->pcm_descriptor_count; ++descriptor_index) {
+      struct epoll_event _event = {};
+      _event.events   = reactor->pcm_descriptors[descriptor_index].events | EPOLLONESHOT;
+      _event.data.u32 = REACTOR_SOURCE_SOUND | (descriptor_index << 16);
+      reactor->pcm_descriptors[descriptor_index].revents = 0;
+      COUNTED_SYSCALL(epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_MOD, reactor->pcm_descriptors[descriptor_index].fd, &_event));
+   }
+}
+
+//Note(LAG): Only called with the event queue drained, anything xcb already read would otherwise sit there until the timeout
+INTERNAL void
+idle_wait(xxcb_reactor* reactor, int timeout_ms) {
+   COUNTED_SYSCALL(xcb_flush(_connection));
+   reactor_wait(reactor, timeout_ms);
+   if(xcb_connection_has_error(_connection)) {
+      is_running = 0;
+   }
+}
+
+INTERNAL bool32
+index_ring_push(xxcb_index_ring* ring, u32 value) {
+   u32 write = __atomic_load_n(&ring->write, __ATOMIC_RELAXED);
+   u32 read  = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+   if(write - read == INDEX_RING_COUNT) {
+      return FALSE;
+   }
+   ring->values[write % INDEX_RING_COUNT] = value;
+   __atomic_store_n(&ring->write, write + 1, __ATOMIC_RELEASE);
+   return TRUE;
+}
+
+INTERNAL bool32
+index_ring_pop(xxcb_index_ring* ring, u32* value) {
+   u32 read  = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+   u32 write = __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE);
+   if(read == write) {
+      return FALSE;
+   }
+   *value = ring->values[read % INDEX_RING_COUNT];
+   __atomic_store_n(&ring->read, read + 1, __ATOMIC_RELEASE);
+   return TRUE;
+}
+
+//Note(LAG): BT.601 limited range in 8.8 fixed point, two rows at a time so each 2x2 block gives one U and one V
+//from the average of its four pixels
+INTERNAL void
+capture_bgrx_to_yuv420_rows(u32* row0, u32* row1, u32 width, u8* y_row0, u8* y_row1, u8* u_row, u8* v_row) {
+   __m128i zero          = _mm_setzero_si128();
+   __m128i y_coefficient = _mm_set_epi16(0, 66, 129, 25, 0, 66, 129, 25);
+   __m128i u_coefficient = _mm_set_epi16(0, -38, -74, 112, 0, -38, -74, 112);
+   __m128i v_coefficient = _mm_set_epi16(0, 112, -94, -18, 0, 112, -94, -18);
+
+   u32 x = 0;
+   for(; x + 8 <= width; x += 8) {
+      __m128i pixels[2][2] = {
+         {_mm_loadu_si128((__m128i*)(row0 + x)), _mm_loadu_si128((__m128i*)(row0 + x + 4))},
+         {_mm_loadu_si128((__m128i*)(row1 + x)), _mm_loadu_si128((__m128i*)(row1 + x + 4))},
+      };
+
+      for(u32 row=0; row < 2; ++row) {
+         __m128i luma[2];
+         for(u32 half=0; half < 2; ++half) {
+            //Note(LAG): madd leaves 25B+129G and 66R per pixel, adding each pair and keeping lanes 0 and 2 gives one Y each
+            __m128i low  = _mm_madd_epi16(_mm_unpacklo_epi8(pixels[row][half], zero), y_coefficient);
+            __m128i high = _mm_madd_epi16(_mm_unpackhi_epi8(pixels[row][half], zero), y_coefficient);
+            low  = _mm_shuffle_epi32(_mm_add_epi32(low,  _mm_srli_epi64(low,  32)), _MM_SHUFFLE(3, 1, 2, 0));
+            high = _mm_shuffle_epi32(_mm_add_epi32(high, _mm_srli_epi64(high, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+            luma[half] = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi64(low, high), _mm_set1_epi32(128)), 8),
+                                       _mm_set1_epi32(16));
+         }
+         __m128i luma_bytes = _mm_packus_epi16(_mm_packs_epi32(luma[0], luma[1]), zero);
+         _mm_storel_epi64((__m128i*)((row ? y_row1 : y_row0) + x), luma_bytes);
+      }
+
+      __m128i blocks[2];
+      for(u32 half=0; half < 2; ++half) {
+         __m128i low  = _mm_add_epi16(_mm_unpacklo_epi8(pixels[0][half], zero), _mm_unpacklo_epi8(pixels[1][half], zero));
+         __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(pixels[0][half], zero), _mm_unpackhi_epi8(pixels[1][half], zero));
+         low  = _mm_add_epi16(low,  _mm_srli_si128(low,  8));
+         high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+         blocks[half] = _mm_unpacklo_epi64(low, high);
+      }
+
+      __m128i chroma[2][2];
+      for(u32 half=0; half < 2; ++half) {
+         __m128i u = _mm_madd_epi16(blocks[half], u_coefficient);
+         __m128i v = _mm_madd_epi16(blocks[half], v_coefficient);
+         chroma[0][half] = _mm_shuffle_epi32(_mm_add_epi32(u, _mm_srli_epi64(u, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+         chroma[1][half] = _mm_shuffle_epi32(_mm_add_epi32(v, _mm_srli_epi64(v, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+      }
+      for(u32 plane=0; plane < 2; ++plane) {
+         //Note(LAG): The block sums are four pixels, so the 8.8 result gets two extra bits of shift
+         __m128i sums  = _mm_unpacklo_epi64(chroma[plane][0], chroma[plane][1]);
+         __m128i value = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(512)), 10), _mm_set1_epi32(128));
+         __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(value, zero), zero);
+         *(u32*)((plane ? v_row : u_row) + x / 2) = _mm_cvtsi128_si32(bytes);
+      }
+   }
+
+   for(; x < width; x += 2) {
+      s32 sum_b = 0;
+      s32 sum_g = 0;
+      s32 sum_r = 0;
+      for(u32 offset=0; offset < 2; ++offset) {
+         for(u32 row=0; row < 2; ++row) {
+            u32 pixel = (row ? row1 : row0)[x + offset];
+            s32 b = (pixel >>  0) & 0xFF;
+            s32 g = (pixel >>  8) & 0xFF;
+            s32 r = (pixel >> 16) & 0xFF;
+            (row ? y_row1 : y_row0)[x + offset] = (u8)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            sum_b += b;
+            sum_g += g;
+            sum_r += r;
+         }
+      }
+      u_row[x / 2] = (u8)(((-38 * sum_r - 74 * sum_g + 112 * sum_b + 512) >> 10) + 128);
+      v_row[x / 2] = (u8)(((112 * sum_r - 94 * sum_g - 18 * sum_b + 512) >> 10) + 128);
+   }
+}
+
+INTERNAL bool32
+capture_write(int file_handle, void* memory, u32 size) {
+   u8* next_byte_location = (u8*)memory;
+   while(size) {
+      ssize_t bytes_written = write(file_handle, next_byte_location, size);
+      if(bytes_written == -1) {
+         return FALSE;
+      }
+      size -= bytes_written;
+      next_byte_location += bytes_written;
+   }
+   return TRUE;
+}
+
+INTERNAL void*
+capture_thread_proc(void* parameter) {
+   xxcb_capture* capture = (xxcb_capture*)parameter;
+   u32 luma_size   = capture->width * capture->height;
+   u32 chroma_size = luma_size / 4;
+
+   for(;;) {
+      sem_wait(&capture->frames_ready);
+
+      u32 slot_index;
+      if(!index_ring_pop(&capture->filled_slots, &slot_index)) {
+         if(!__atomic_load_n(&capture->is_running, __ATOMIC_ACQUIRE)) {
+            break;
+         }
+         continue;
+      }
+
+      //Note(LAG): After the first failed write the file stays truncated there, every later frame only counts as dropped
+      u32* pixels = (u32*)capture->slots[slot_index];
+      bool32 is_written = FALSE;
+      if(!capture->has_failed && capture->format == CAPTURE_FORMAT_Y4M) {
+         u8* y_plane = capture->yuv_frame;
+         u8* u_plane = y_plane + luma_size;
+         u8* v_plane = u_plane + chroma_size;
+         for(u32 y=0; y < capture->height; y += 2) {
+            capture_bgrx_to_yuv420_rows(pixels + y * capture->width,
+                                        pixels + (y + 1) * capture->width,
+                                        capture->width,
+                                        y_plane + y * capture->width,
+                                        y_plane + (y + 1) * capture->width,
+                                        u_plane + (y / 2) * (capture->width / 2),
+                                        v_plane + (y / 2) * (capture->width / 2));
+         }
+         is_written = capture_write(capture->file_handle, "FRAME\n", 6) &&
+                      capture_write(capture->file_handle, capture->yuv_frame, luma_size + 2 * chroma_size);
+      } else if(!capture->has_failed) {
+         is_written = capture_write(capture->file_handle, pixels, luma_size * BYTES_PER_PIXEL);
+      }
+      if(is_written) {
+         ++capture->frames_written;
+      } else {
+         if(!capture->has_failed) {
+            capture->write_error = errno;
+            capture->has_failed  = TRUE;
+         }
+         __atomic_add_fetch(&capture->frames_dropped, 1, __ATOMIC_RELAXED);
+      }
+
+      index_ring_push(&capture->free_slots, slot_index);
+   }
+
+   return 0;
+}
+
+//Note(LAG): The stream size is fixed by the first frame and rounded down to even for 4:2:0, later frames of another size
+//(a resized window) are cropped or padded with black into it
+INTERNAL bool32
+capture_start(xxcb_capture* capture, char* path, capture_format format, u16 width, u16 height, u32 frame_rate) {
+   capture->format     = format;
+   capture->width      = width & ~1;
+   capture->height     = height & ~1;
+   capture->frame_rate = frame_rate;
+   if(!capture->width || !capture->height) {
+      return FALSE;
+   }
+
+   capture->file_handle = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+   if(capture->file_handle == -1) {
+      return FALSE;
+   }
+
+   u32 slot_size = capture->width * capture->height * BYTES_PER_PIXEL;
+   u32 yuv_size  = capture->width * capture->height * 3 / 2;
+   u8* memory = mmap(0,
+                     CAPTURE_SLOT_COUNT * slot_size + yuv_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+   if(memory == MAP_FAILED) {
+      close(capture->file_handle);
+      return FALSE;
+   }
+   for(u32 slot_index=0; slot_index < CAPTURE_SLOT_COUNT; ++slot_index) {
+      capture->slots[slot_index] = memory + slot_index * slot_size;
+      index_ring_push(&capture->free_slots, slot_index);
+   }
+   capture->yuv_frame = memory + CAPTURE_SLOT_COUNT * slot_size;
+
+   if(format == CAPTURE_FORMAT_Y4M) {
+      char header[128];
+      int length = sprintf(header, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", capture->width, capture->height, frame_rate);
+      if(!capture_write(capture->file_handle, header, length)) {
+         int write_error = errno;
+         close(capture->file_handle);
+         munmap(memory, CAPTURE_SLOT_COUNT * slot_size + yuv_size);
+         errno = write_error;
+         return FALSE;
+      }
+   }
+
+   sem_init(&capture->frames_ready, 0, 0);
+   capture->is_running = TRUE;
+   if(pthread_create(&capture->thread, 0, capture_thread_proc, capture) != 0) {
+      capture->is_running = FALSE;
+      close(capture->file_handle);
+      munmap(memory, CAPTURE_SLOT_COUNT * slot_size + yuv_size);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+//Note(LAG): All the main thread pays is a copy into a recycled slot, when the writer falls behind the frame is dropped
+//and counted instead of waiting on the disk
+INTERNAL void
+capture_submit_frame(xxcb_capture* capture, void* pixels, u16 width, u16 height, u16 pitch) {
+   u32 slot_index;
+   if(!index_ring_pop(&capture->free_slots, &slot_index)) {
+      __atomic_add_fetch(&capture->frames_dropped, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   u8* slot       = capture->slots[slot_index];
+   u32 slot_pitch = capture->width * BYTES_PER_PIXEL;
+   u32 copy_bytes = (width < capture->width ? width : capture->width) * BYTES_PER_PIXEL;
+   for(u32 y=0; y < capture->height; ++y) {
+      if(y < height) {
+         memcpy(slot + y * slot_pitch, (u8*)pixels + y * pitch, copy_bytes);
+         memset(slot + y * slot_pitch + copy_bytes, 0, slot_pitch - copy_bytes);
       } else {
-         //TODO(LAG): Diagnostic
+         memset(slot + y * slot_pitch, 0, slot_pitch);
       }
-   }  
+   }
+
+   index_ring_push(&capture->filled_slots, slot_index);
+   COUNTED_SYSCALL(sem_post(&capture->frames_ready));
 }
 
 INTERNAL void
-alsa_init(int samples_per_second, int samples_per_write) {
-   snd_pcm_hw_params_t* _pcm_hw_params;
-
-   if(snd_pcm_open(&_pcm, "default", SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0) {
-      //TODO(LAG) Diagnostic
+capture_stop(xxcb_capture* capture) {
+   __atomic_store_n(&capture->is_running, FALSE, __ATOMIC_RELEASE);
+   sem_post(&capture->frames_ready);
+   pthread_join(capture->thread, 0);
+   close(capture->file_handle);
+   printf("capture: %u frames written, %u dropped\n", capture->frames_written, capture->frames_dropped);
+   if(capture->has_failed) {
+      char message[256];
+      int length = snprintf(message, sizeof(message), "capture: write failed after %u frames: %s\n",
+                            capture->frames_written, strerror(capture->write_error));
+      write(STDERR_FILENO, message, length);
    }
+}
 
-   _pcm_hw_params = (snd_pcm_hw_params_t*)mmap(0,
-                                               snd_pcm_hw_params_sizeof(),
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1,
-                                               0);
-   snd_pcm_hw_params_any(_pcm, _pcm_hw_params);
-
-   snd_pcm_hw_params_set_access(_pcm, _pcm_hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-   snd_pcm_hw_params_set_format(_pcm, _pcm_hw_params, SND_PCM_FORMAT_S16_LE);
-   snd_pcm_hw_params_set_channels(_pcm, _pcm_hw_params, 2);
-   snd_pcm_hw_params_set_rate(_pcm, _pcm_hw_params, samples_per_second, 0);
-   snd_pcm_hw_params_set_buffer_size(_pcm, _pcm_hw_params, samples_per_write);
-   snd_pcm_hw_params_set_period_time(_pcm, _pcm_hw_params, 100000, 0);
-
-   snd_pcm_hw_params(_pcm, _pcm_hw_params);
+#if HANDMADE_WORK_QUEUE
+//Note(LAG): Bounded MPMC ring, every entry carries a sequence number that says whose turn it is. It is the position
+//once the entry is free for that writer and the position plus one once it holds work for that reader, so any thread
+//can add or take with a single compare and swap on the shared position
+INTERNAL bool32
+work_queue_do_next_entry(platform_work_queue* queue) {
+   u32 position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+   for(;;) {
+      platform_work_queue_entry* entry = &queue->entries[position % WORK_QUEUE_ENTRY_COUNT];
+      s32 difference = (s32)(__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) - (position + 1));
+      if(difference < 0) {
+         return FALSE;
+      }
+      if(difference > 0) {
+         position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+         continue;
+      }
+      if(__atomic_compare_exchange_n(&queue->dequeue_position, &position, position + 1, TRUE,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+         platform_work_queue_callback* callback = entry->callback;
+         void* data = entry->data;
+         __atomic_store_n(&entry->sequence, position + WORK_QUEUE_ENTRY_COUNT, __ATOMIC_RELEASE);
+
+         callback(queue, data);
+         __atomic_add_fetch(&queue->completion_count, 1, __ATOMIC_RELEASE);
+         return TRUE;
+      }
+   }
 }
 
 INTERNAL void
-unflushed_resize_backbuffer(xxcb_offscreen_buffer* buffer, u16 width, u16 height) {
-   if(buffer->pixels) {
-      munmap(buffer->pixels, buffer->width * buffer->height * BYTES_PER_PIXEL);
-   }
-   if(buffer->pixmap) {
-      xcb_free_pixmap(_connection, buffer->pixmap);
+work_queue_add_entry(platform_work_queue* queue, platform_work_queue_callback* callback, void* data) {
+   //Note(LAG): Counted before it can be taken, complete_all_work must never see the work done before it was added
+   __atomic_add_fetch(&queue->completion_goal, 1, __ATOMIC_RELAXED);
+
+   u32 position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+   for(;;) {
+      platform_work_queue_entry* entry = &queue->entries[position % WORK_QUEUE_ENTRY_COUNT];
+      s32 difference = (s32)(__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) - position);
+      if(difference < 0) {
+         //Note(LAG): Full, the caller runs one entry itself instead of waiting on the workers
+         work_queue_do_next_entry(queue);
+         position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+         continue;
+      }
+      if(difference > 0) {
+         position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+         continue;
+      }
+      if(__atomic_compare_exchange_n(&queue->enqueue_position, &position, position + 1, TRUE,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+         entry->callback = callback;
+         entry->data = data;
+         __atomic_store_n(&entry->sequence, position + 1, __ATOMIC_RELEASE);
+         break;
+      }
    }
 
-   buffer->width  = width;
-   buffer->height = height;
-   buffer->pitch  = width * BYTES_PER_PIXEL;
-   buffer->pixels = mmap(0,
-                         width * height * BYTES_PER_PIXEL,
-                         PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS,
-                         -1,
-                         0);
-
-   buffer->pixmap = xcb_generate_id(_connection);
-   xcb_create_pixmap(_connection, _screen->root_depth, buffer->pixmap, _window, width, height);
+   sem_post(&queue->semaphore);
 }
 
+//Note(LAG): The caller works through the queue with the pool rather than sleeping until it drains
 INTERNAL void
-unflushed_update_window(xxcb_offscreen_buffer buffer, u16 width, u16 height) {
-   xcb_put_image(_connection,
-                 XCB_IMAGE_FORMAT_Z_PIXMAP,
-                 buffer.pixmap,
-                 _gcontext,
-                 width, height,
-                 0, 0,
-                 0,
-                 _screen->root_depth,
-                 width * height * BYTES_PER_PIXEL, (u8*)buffer.pixels);
-   xcb_copy_area(_connection, buffer.pixmap, _window, _gcontext, 0, 0, 0, 0, width, height);
+work_queue_complete_all_work(platform_work_queue* queue) {
+   while(__atomic_load_n(&queue->completion_count, __ATOMIC_ACQUIRE) != __atomic_load_n(&queue->completion_goal, __ATOMIC_RELAXED)) {
+      work_queue_do_next_entry(queue);
+   }
 }
 
-INTERNAL void
-joystick_input_process(game_button_state* old_state, game_button_state* new_state, s16 value) {
-   new_state->ended_down = value;
-   new_state->half_transition_count = (old_state->ended_down != new_state->ended_down) ? 1 : 0;
+INTERNAL void*
+work_queue_thread_proc(void* parameter) {
+   platform_work_queue* queue = (platform_work_queue*)parameter;
+   for(;;) {
+      if(!work_queue_do_next_entry(queue)) {
+         sem_wait(&queue->semaphore);
+      }
+   }
+   return 0;
 }
 
-INTERNAL f32
-joystick_axis_process(s16 value) {
-   s16 dead_zone = 7849;
-   f32 axis_limit = 32767.0f;
-   if(abs(value) < dead_zone) {
-      return 0;
-   } else if(value < -dead_zone) {
-      return (f32)((value + dead_zone) / (axis_limit - dead_zone));
+INTERNAL void
+work_queue_init(platform_work_queue* queue) {
+   for(u32 entry_index=0; entry_index < WORK_QUEUE_ENTRY_COUNT; ++entry_index) {
+      queue->entries[entry_index].sequence = entry_index;
+   }
+   sem_init(&queue->semaphore, 0, 0);
+
+   //Note(LAG): The thread that calls complete_all_work is the last worker, so one less than the online CPUs are started
+   long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+   queue->thread_count = cpu_count > 1 ? (u32)(cpu_count - 1) : 0;
+   if(queue->thread_count > WORK_QUEUE_THREAD_COUNT) {
+      queue->thread_count = WORK_QUEUE_THREAD_COUNT;
+   }
+   for(u32 thread_index=0; thread_index < queue->thread_count; ++thread_index) {
+      if(pthread_create(&queue->threads[thread_index], 0, work_queue_thread_proc, queue) != 0) {
+         queue->thread_count = thread_index;
+         break;
+      }
+      pthread_detach(queue->threads[thread_index]);
    }
-   return (f32)((value - dead_zone) / (axis_limit - dead_zone));
 }
 
 INTERNAL void
-keyboard_input_process(game_button_state* new_state, bool32 is_down) {
-   new_state->ended_down = is_down;
-   ++new_state->half_transition_count;
+work_queue_attach(game_memory* gmemory) {
+   work_queue_init(&global_work_queue);
+   gmemory->high_priority_queue        = &global_work_queue;
+   gmemory->platform_add_entry         = work_queue_add_entry;
+   gmemory->platform_complete_all_work = work_queue_complete_all_work;
 }
+#endif
 
-INTERNAL struct timeval
-get_timeval(void) {
-   struct timeval tv;
-   gettimeofday(&tv, 0);
-   return tv;
+#if HANDMADE_HEADLESS
+INTERNAL int
+headless_main(void) {
+   int game_update_hz = 30;
+   f32 target_seconds_per_frame = 1.0f / (f32)game_update_hz;
+
+   alsa_sound_output sound_output = {};
+   sound_output.samples_per_second = 48000;
+   sound_output.bytes_per_sample = HANDMADE_AUDIO_FLOAT ? 2 * sizeof(f32) : 2 * sizeof(s16);
+
+   //Note(LAG): Stand-ins for the window and the sound device, plain memory the game writes into and nobody reads
+   xxcb_offscreen_buffer backbuffer = {};
+   backbuffer.width  = HANDMADE_RENDER_WIDTH ? HANDMADE_RENDER_WIDTH  : 1280;
+   backbuffer.height = HANDMADE_RENDER_WIDTH ? HANDMADE_RENDER_HEIGHT : 720;
+   backbuffer.pitch  = backbuffer.width * BYTES_PER_PIXEL;
+   backbuffer.pixels = mmap(0,
+                            backbuffer.pitch * backbuffer.height,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+
+   int samples_per_frame = sound_output.samples_per_second / game_update_hz;
+   s16* samples = mmap(0,
+                       samples_per_frame * sound_output.bytes_per_sample,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+
+   game_input input[2] = {};
+   game_input* new_input = &input[0];
+   game_input* old_input = &input[1];
+
+   game_memory gmemory = {};
+   gmemory.permanent_storage_size = MEGABYTES(64);
+   gmemory.transient_storage_size = GIGABYTES(1);
+   u64 total_size = gmemory.permanent_storage_size + gmemory.transient_storage_size;
+   page_kind gmemory_pages;
+   gmemory.permanent_storage = pages_allocate(total_size, HANDMADE_HUGE_PAGES, &gmemory_pages);
+   gmemory.transient_storage = ((u8*)gmemory.permanent_storage + gmemory.permanent_storage_size);
+   if(HANDMADE_HUGE_PAGES) {
+      printf("game memory: %s pages\n", page_kind_name(gmemory_pages));
+   }
+#if HANDMADE_WORK_QUEUE
+   work_queue_attach(&gmemory);
+#endif
+
+   if(backbuffer.pixels == MAP_FAILED || samples == MAP_FAILED || !gmemory.permanent_storage) {
+      return 1;
+   }
+
+   f32 total_seconds = 0.0f;
+   f32 min_seconds   = 1000.0f;
+   f32 max_seconds   = 0.0f;
+   u64 total_cycles  = 0;
+
+   struct timeval last_counter = get_timeval();
+   for(int frame_index=0; frame_index < HANDMADE_HEADLESS_FRAMES; ++frame_index) {
+      game_controller_input zero_controller = {};
+      game_controller_input* new_controller = &new_input->controllers[0];
+      game_controller_input* old_controller = &old_input->controllers[0];
+      *new_controller = zero_controller;
+      for(int button_index=0; button_index < ARRAY_COUNT(new_controller->buttons); ++button_index) {
+         new_controller->buttons[button_index].ended_down = old_controller->buttons[button_index].ended_down;
+      }
+
+      game_sound_output_buffer sound_buffer = {};
+      sound_buffer.samples_per_second = sound_output.samples_per_second;
+      sound_buffer.sample_count = samples_per_frame;
+      sound_buffer.samples = samples;
+
+      game_offscreen_buffer buffer = {};
+      buffer.memory = backbuffer.pixels;
+      buffer.width = backbuffer.width;
+      buffer.height = backbuffer.height;
+      buffer.pitch = backbuffer.pitch;
+
+      u64 start_cycle_count = __rdtsc();
+      struct timeval start_counter = get_timeval();
+      game_update_render(&gmemory, new_input, &buffer, &sound_buffer);
+      f32 work_seconds = get_seconds_elapsed(start_counter, get_timeval());
+      total_cycles += __rdtsc() - start_cycle_count;
+
+      total_seconds += work_seconds;
+      min_seconds = work_seconds < min_seconds ? work_seconds : min_seconds;
+      max_seconds = work_seconds > max_seconds ? work_seconds : max_seconds;
+
+      if(HANDMADE_HEADLESS_FIXED_STEP) {
+         f32 seconds_elapsed_for_frame = get_seconds_elapsed(last_counter, get_timeval());
+         if(seconds_elapsed_for_frame < target_seconds_per_frame) {
+            usleep((s32)((1000.0f*1000.0f) * (target_seconds_per_frame - seconds_elapsed_for_frame)));
+         }
+      }
+      last_counter = get_timeval();
+
+      game_input* temp = new_input;
+      new_input = old_input;
+      old_input = temp;
+   }
+
+   printf("%d frames at %dx%d: %.3fms/f avg, %.3fms/f min, %.3fms/f max, %.2fmc/f\n",
+          HANDMADE_HEADLESS_FRAMES, backbuffer.width, backbuffer.height,
+          1000.0f * total_seconds / HANDMADE_HEADLESS_FRAMES,
+          1000.0f * min_seconds,
+          1000.0f * max_seconds,
+          (f32)total_cycles / (HANDMADE_HEADLESS_FRAMES * 1000.0f * 1000.0f));
+   return 0;
 }
+#endif
 
-INTERNAL f32
-get_seconds_elapsed(struct timeval tv_start, struct timeval tv_end) {
-   return (f32)(((tv_end.tv_sec * 1000000) + tv_end.tv_usec) - ((tv_start.tv_sec * 1000000) + tv_start.tv_usec)) / (1000.0f*1000.0f);
+#if HANDMADE_PAGE_BENCHMARK
+//Note(LAG): A 4K frame, filled the way the game fills it and copied in 64x64 tiles the way the upload path reads it.
+//In a tile every row is on another 4KB page, which is where the page size shows
+INTERNAL int
+page_benchmark_main(void) {
+   u32 width      = 3840;
+   u32 height     = 2160;
+   u32 iterations = 30;
+   u64 size       = (u64)width * height * BYTES_PER_PIXEL;
+   u64 checksum   = 0;
+
+   for(u32 use_huge_pages=0; use_huge_pages < 2; ++use_huge_pages) {
+      page_kind source_pages;
+      page_kind destination_pages;
+      u32* source      = (u32*)pages_allocate(size, use_huge_pages, &source_pages);
+      u32* destination = (u32*)pages_allocate(size, use_huge_pages, &destination_pages);
+      if(!source || !destination) {
+         printf("%s: allocation failed\n", use_huge_pages ? "huge" : "normal");
+         continue;
+      }
+      //Note(LAG): Faulted in first, only the steady state is measured
+      memset(source, 0, size);
+      memset(destination, 0, size);
+
+      struct timeval start_counter = get_timeval();
+      for(u32 iteration=0; iteration < iterations; ++iteration) {
+         for(u32 y=0; y < height; ++y) {
+            u32* row = source + y * width;
+            for(u32 x=0; x < width; ++x) {
+               row[x] = ((y + iteration) & 0xFF) << 8 | ((x + iteration) & 0xFF);
+            }
+         }
+      }
+      f32 fill_seconds = get_seconds_elapsed(start_counter, get_timeval());
+
+      start_counter = get_timeval();
+      for(u32 iteration=0; iteration < iterations; ++iteration) {
+         for(u32 tile_y=0; tile_y < height; tile_y += TILE_SIZE) {
+            for(u32 tile_x=0; tile_x < width; tile_x += TILE_SIZE) {
+               u32 tile_width  = width  - tile_x < TILE_SIZE ? width  - tile_x : TILE_SIZE;
+               u32 tile_height = height - tile_y < TILE_SIZE ? height - tile_y : TILE_SIZE;
+               for(u32 y=tile_y; y < tile_y + tile_height; ++y) {
+                  memcpy(destination + y * width + tile_x, source + y * width + tile_x, tile_width * BYTES_PER_PIXEL);
+               }
+            }
+         }
+      }
+      f32 blit_seconds = get_seconds_elapsed(start_counter, get_timeval());
+
+      checksum += destination[(height / 2) * width + width / 2];
+      f32 gigabytes = (f32)(size * iterations) / (1024.0f * 1024.0f * 1024.0f);
+      printf("%-18s fill %6.2f GB/s, tile blit %6.2f GB/s\n",
+             page_kind_name(source_pages), gigabytes / fill_seconds, gigabytes / blit_seconds);
+
+      pages_free(source, size, use_huge_pages);
+      pages_free(destination, size, use_huge_pages);
+   }
+
+   //Note(LAG): Printed so the copies cannot be optimized away
+   printf("checksum %llx\n", (unsigned long long)checksum);
+   return 0;
 }
+#endif
 
 int main() {
+#if HANDMADE_PAGE_BENCHMARK
+   return page_benchmark_main();
+#endif
+#if HANDMADE_HEADLESS
+   return headless_main();
+#endif
+
    _connection = xcb_connect(0, 0);
    if(xcb_connection_has_error(_connection)) {
       //TODO(LAG): Log error
@@ -242,6 +3261,9 @@ int main() {
 
    _screen = xcb_setup_roots_iterator(xcb_get_setup(_connection)).data;
 
+   //Note(LAG): Enables BIG-REQUESTS when the server has it, the length is read once the window setup below is done
+   xcb_prefetch_maximum_request_length(_connection);
+
    {
       xcb_xkb_use_extension(_connection, 
                             XCB_XKB_MAJOR_VERSION, 
@@ -268,12 +3290,15 @@ int main() {
    }
 
    int monitor_refresh_hz = 60;
-   int game_update_hz = monitor_refresh_hz / 2;
+   int refreshes_per_frame = 2;
+   int game_update_hz = monitor_refresh_hz / refreshes_per_frame;
    f32 target_seconds_per_frame = 1.0f / (f32)game_update_hz;
 
    u32 _window_mask = XCB_CW_EVENT_MASK;
-   u32 _window_values[] = {XCB_EVENT_MASK_EXPOSURE         |
-                           XCB_EVENT_MASK_STRUCTURE_NOTIFY |
+   u32 _window_values[] = {XCB_EVENT_MASK_EXPOSURE          |
+                           XCB_EVENT_MASK_STRUCTURE_NOTIFY  |
+                           XCB_EVENT_MASK_VISIBILITY_CHANGE |
+                           XCB_EVENT_MASK_FOCUS_CHANGE      |
                            XCB_EVENT_MASK_KEY_PRESS        |
                            XCB_EVENT_MASK_KEY_RELEASE};
 
@@ -307,6 +3332,67 @@ int main() {
    _gcontext = xcb_generate_id(_connection);
    xcb_create_gc(_connection, _gcontext, _screen->root, 0, 0);
 
+   _maximum_request_bytes = xcb_get_maximum_request_length(_connection) * 4;
+   bool32 has_avx2 = __builtin_cpu_supports("avx2");
+   if(!pixel_format_init(&_pixel_format, has_avx2)) {
+      char message[128];
+      int length = snprintf(message, sizeof(message), "unsupported visual: depth %u, %u bits per pixel\n",
+                            _pixel_format.depth, _pixel_format.bits_per_pixel);
+      write(STDERR_FILENO, message, length);
+      xcb_disconnect(_connection);
+      return 1;
+   }
+   if(has_avx2) {
+      tile_hash        = tile_hash_avx2;
+      stretch_nearest  = stretch_nearest_avx2;
+      stretch_bilinear = stretch_bilinear_avx2;
+   } else {
+      tile_hash        = tile_hash_sse2;
+      stretch_nearest  = stretch_nearest_sse2;
+      stretch_bilinear = stretch_bilinear_sse2;
+   }
+   _shm_available = shm_query_support();
+   if(_shm_available) {
+      _shm_completion_event = xcb_get_extension_data(_connection, &xcb_shm_id)->first_event + XCB_SHM_COMPLETION;
+      global_backbuffer_count = BACKBUFFER_COUNT;
+   } else {
+      //Note(LAG): xcb_put_image copies the pixels out before returning, one buffer is all the fallback needs
+      global_backbuffer_count = 1;
+   }
+
+   if(HANDMADE_RENDER_WIDTH) {
+      if(HANDMADE_RENDER_SCALER == RENDER_SCALER_XRENDER) {
+         _xrender_available = xrender_init(HANDMADE_RENDER_WIDTH, HANDMADE_RENDER_HEIGHT,
+                                           HANDMADE_RENDER_FILTER,
+                                           HANDMADE_RENDER_LETTERBOX);
+      }
+      if(!_xrender_available) {
+         render_buffer_init(&global_render_buffer,
+                            HANDMADE_RENDER_WIDTH, HANDMADE_RENDER_HEIGHT,
+                            HANDMADE_RENDER_FILTER,
+                            HANDMADE_RENDER_LETTERBOX);
+      }
+   }
+
+   //Note(LAG): Present needs a pixmap per buffer that can stay with the server until it is idle, so it is only used with SHM,
+   //and it shows the pixmap as it is, so not when XRender is the one scaling it to the window
+   _present_available = _shm_available && !_xrender_available && present_query_support();
+   if(_present_available) {
+      xcb_present_event_t _present_event_id = xcb_generate_id(_connection);
+      _present_special_event = xcb_register_for_special_xge(_connection, &xcb_present_id, _present_event_id, 0);
+      xcb_present_select_input(_connection,
+                               _present_event_id,
+                               _window,
+                               XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY | XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+   }
+
+   _randr_available = randr_query_support();
+   if(_randr_available) {
+      xcb_randr_select_input(_connection,
+                             _window,
+                             XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+   }
+
    xcb_flush(_connection);
 
    int _joystick_descriptor = open("/dev/input/js0", O_RDONLY | O_NONBLOCK);
@@ -323,32 +3409,78 @@ int main() {
    sound_output.bytes_per_sample = 2 * sizeof(s16);
    sound_output.tone_hz = 256;
 
-   alsa_init(sound_output.samples_per_second, sound_output.samples_per_write);
+   sound_output.samples_per_write = alsa_init(sound_output.samples_per_second, sound_output.samples_per_write);
+   sound_output.bytes_per_sample = snd_pcm_frames_to_bytes(_pcm, 1);
+   if(HANDMADE_AUDIO_FLOAT) {
+      audio_convert = audio_convert_select(_pcm_format, has_avx2);
+   }
+
+   //Note(LAG): With the event thread the loop waits on its eventfd in place of the X connection
+   int _x_descriptor = xcb_get_file_descriptor(_connection);
+   if(HANDMADE_EVENT_THREAD && event_thread_start(&_event_thread)) {
+      _x_descriptor = _event_thread.wake_descriptor;
+   }
+
+   //Note(LAG): The audio thread owns the PCM from here on, the loop only ever touches the ring
+   if(HANDMADE_AUDIO_THREAD) {
+      audio_thread_start(&_audio_thread, &sound_output, sound_output.samples_per_write);
+   }
+
+   xxcb_reactor reactor = {};
+   reactor_init(&reactor, _x_descriptor, _joystick_descriptor, !_audio_thread.is_running);
 
    struct timeval last_counter = get_timeval();
 
+#if HANDMADE_TELEMETRY
    u64 last_cycle_count = __rdtsc();
+   u64 last_x_bytes_written = xcb_total_written(_connection);
+#endif
 
    is_running  = 1;
 
-   s16* samples = mmap(0,
-                       sound_output.samples_per_write * sound_output.bytes_per_sample,
-                       PROT_READ | PROT_WRITE,
-                       MAP_PRIVATE | MAP_ANONYMOUS,
-                       -1,
-                       0);
+   //Note(LAG): Under two game frames one late frame is already an xrun, and shrinking there only grows again
+   xxcb_audio_latency audio_latency = {};
+   audio_latency.min_frames = sound_output.samples_per_second * HANDMADE_AUDIO_MIN_MS / 1000;
+   if(audio_latency.min_frames < 2 * (u32)(sound_output.samples_per_second * target_seconds_per_frame)) {
+      audio_latency.min_frames = 2 * (u32)(sound_output.samples_per_second * target_seconds_per_frame);
+   }
+   audio_latency.max_frames = sound_output.samples_per_second * HANDMADE_AUDIO_MAX_MS / 1000;
+   if(_audio_thread.is_running && audio_latency.max_frames > _audio_thread.ring.frame_count * 3 / 4) {
+      audio_latency.max_frames = _audio_thread.ring.frame_count * 3 / 4;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &audio_latency.last_change);
+
+   //Note(LAG): Writing through mmap from the loop the game gets the device memory itself, the scratch is not needed.
+   //Otherwise it has room for the largest buffer the adaptive sizing can pick, in the device format
+   bool32 is_direct_mmap = _pcm_is_mmap && !_audio_thread.is_running;
+   u32 sample_capacity = audio_latency.max_frames > _audio_thread.ring.frame_count ?
+                         audio_latency.max_frames : _audio_thread.ring.frame_count;
+   sample_capacity = sample_capacity > sound_output.samples_per_write ? sample_capacity : sound_output.samples_per_write;
+   s16* samples = 0;
+   if(!is_direct_mmap) {
+      samples = mmap(0,
+                     sample_capacity * sound_output.bytes_per_sample,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+   }
+   f32* bus = 0;
+   if(HANDMADE_AUDIO_FLOAT) {
+      bus = mmap(0,
+                 sample_capacity * 2 * sizeof(f32),
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1,
+                 0);
+   }
 
-   {
-      game_sound_output_buffer sound_buffer = {};
-      sound_buffer.samples_per_second = sound_output.samples_per_second;
-      sound_buffer.sample_count = sound_output.samples_per_write;
-      sound_buffer.samples = samples;
-      s16* sample_out = samples;
-      for(int i=0; i<sound_buffer.sample_count; ++i) {
-         *sample_out++ = 0;
-         *sample_out++ = 0;
-      }
-      alsa_fill_sound_buffer(&sound_buffer);
+   xxcb_audio_sync audio_sync = {};
+   snd_pcm_status_t* pcm_status;
+   snd_pcm_status_alloca(&pcm_status);
+
+   if(!_audio_thread.is_running) {
+      audio_sync.frames_written += alsa_write_silence(sound_output.samples_per_write, sound_output.bytes_per_sample);
    }
 
    game_input input[2] = {};
@@ -359,22 +3491,54 @@ int main() {
    gmemory.permanent_storage_size = MEGABYTES(64);
    gmemory.transient_storage_size = GIGABYTES(1);
    u64 total_size = gmemory.permanent_storage_size + gmemory.transient_storage_size;
-   gmemory.permanent_storage = mmap(0,
-                                    total_size,
-                                    PROT_READ | PROT_WRITE,
-                                    MAP_PRIVATE | MAP_ANONYMOUS,
-                                    -1,
-                                    0);
+   page_kind gmemory_pages;
+   gmemory.permanent_storage = pages_allocate(total_size, HANDMADE_HUGE_PAGES, &gmemory_pages);
    gmemory.transient_storage = ((u8*)gmemory.permanent_storage + gmemory.permanent_storage_size);
+   if(HANDMADE_HUGE_PAGES) {
+      printf("game memory: %s pages\n", page_kind_name(gmemory_pages));
+   }
+#if HANDMADE_WORK_QUEUE
+   work_queue_attach(&gmemory);
+#endif
 
-   if(!samples || !gmemory.permanent_storage || !gmemory.transient_storage) {
+   if((!samples && !is_direct_mmap) || (HANDMADE_AUDIO_FLOAT && bus == MAP_FAILED) ||
+      !gmemory.permanent_storage || !gmemory.transient_storage) {
       return 1;
    }
 
+   xxcb_capture capture = {};
+
+   u16 pending_width  = 0;
+   u16 pending_height = 0;
+   s16 window_x       = 0;
+   s16 window_y       = 0;
+   s16 parent_x       = 0;
+   s16 parent_y       = 0;
+   bool32 refresh_rate_changed = _randr_available;
+   bool32 is_position_stale    = _randr_available;
+   bool32 is_crtc_stale        = FALSE;
+   s32 crtc_index              = -1;
+   xxcb_crtc_layout crtc_layout = {};
+   u16 window_width   = 0;
+   u16 window_height  = 0;
+   bool32 is_mapped   = FALSE;
+   bool32 is_obscured = FALSE;
+   bool32 is_focused  = TRUE;
+   bool32 is_idle     = FALSE;
+   s16 expose_x       = 0;
+   s16 expose_y       = 0;
+   u16 expose_width   = 0;
+   u16 expose_height  = 0;
+
    while (is_running) {
       xcb_generic_event_t* _event;
       struct js_event      _joystick_event;
 
+      if(is_idle) {
+         idle_wait(&reactor, HANDMADE_IDLE_TIMEOUT_MS);
+      }
+      u32 ready = reactor_begin_frame(&reactor);
+
       game_controller_input* old_controller = &old_input->controllers[0];
       game_controller_input* new_controller = &new_input->controllers[0];
       game_controller_input* new_keyboard_controller = &new_input->controllers[0];
@@ -388,7 +3552,8 @@ int main() {
       }
 
 
-      while(read(_joystick_descriptor, &_joystick_event, sizeof(struct js_event)) == sizeof(struct js_event)) {
+      while((ready & REACTOR_SOURCE_JOYSTICK) &&
+            COUNTED_SYSCALL(read(_joystick_descriptor, &_joystick_event, sizeof(struct js_event))) == sizeof(struct js_event)) {
          new_controller->is_analog = TRUE;
          _joystick_event.type &= ~JS_EVENT_INIT;
          switch(_joystick_event.type) {
@@ -442,40 +3607,78 @@ int main() {
          }
       }
 
-      while ((_event = xcb_poll_for_event(_connection))) {
-         switch(_event->response_type &~0x80) {
-            case XCB_CLIENT_MESSAGE:
+      xxcb_event_record record;
+      while(next_event_record(ready & REACTOR_SOURCE_X, &record)) {
+         switch(record.type) {
+            case EVENT_RECORD_CLOSE:
+            {
+               is_running = 0;
+            } break;
+            case EVENT_RECORD_CONFIGURE:
             {
-               xcb_client_message_event_t* _client_message = (xcb_client_message_event_t*)_event;
-               if(_client_message->data.data32[0] == _wm_delete_protocol) {
-                  is_running = 0;
+               //Note(LAG): A drag-resize sends many of these per frame, only the last size is applied once the queue is drained
+               pending_width  = record.width;
+               pending_height = record.height;
+               //Note(LAG): A move or a resize may have put the centre on a monitor with another rate. Real events are
+               //relative to the parent, the frame under a reparenting WM, only synthetic ones (ICCCM 4.1.5) are on the root.
+               //A real one that changes the offset in the parent is a move by a WM that does not reparent, or a new frame
+               if(record.value) {
+                  window_x = record.x;
+                  window_y = record.y;
+               } else if(record.x != parent_x || record.y != parent_y) {
+                  parent_x = record.x;
+                  parent_y = record.y;
+                  is_position_stale = _randr_available;
                }
+               is_crtc_stale = _randr_available;
             } break;
-            case XCB_CONFIGURE_NOTIFY:
+            case EVENT_RECORD_MAP:
             {
-               xcb_configure_notify_event_t* _configure_notify_event = (xcb_configure_notify_event_t*)_event;
-               u16 width  = _configure_notify_event->width;
-               u16 height = _configure_notify_event->height;
-
-               unflushed_resize_backbuffer(&global_backbuffer, width, height);
-               xcb_flush(_connection);
+               is_mapped = record.value;
+            } break;
+            case EVENT_RECORD_VISIBILITY:
+            {
+               is_obscured = record.value;
+            } break;
+            case EVENT_RECORD_FOCUS:
+            {
+               is_focused = record.value;
             } break;
-            case XCB_EXPOSE:
+            case EVENT_RECORD_EXPOSE:
             {
-               xcb_expose_event_t* _expose_event = (xcb_expose_event_t*)_event;
-               u16 width = _expose_event->width;
-               u16 height = _expose_event->height;
+               //Note(LAG): A run of exposes ends with count 0, the run is repaired with one copy of the rectangle around it
+               s32 min_x = record.x;
+               s32 min_y = record.y;
+               s32 max_x = record.x + record.width;
+               s32 max_y = record.y + record.height;
+               if(expose_width && expose_height) {
+                  min_x = min_x < expose_x ? min_x : expose_x;
+                  min_y = min_y < expose_y ? min_y : expose_y;
+                  max_x = max_x > expose_x + expose_width  ? max_x : expose_x + expose_width;
+                  max_y = max_y > expose_y + expose_height ? max_y : expose_y + expose_height;
+               }
+               expose_x      = min_x;
+               expose_y      = min_y;
+               expose_width  = max_x - min_x;
+               expose_height = max_y - min_y;
+
+               if(record.value == 0) {
+                  unflushed_expose_window(global_backbuffer,
+                                          expose_x, expose_y, expose_width, expose_height,
+                                          pending_width, pending_height);
+                  expose_width  = 0;
+                  expose_height = 0;
+               }
             } break;
-            case XCB_KEY_RELEASE:
-            case XCB_KEY_PRESS:
+            case EVENT_RECORD_KEY_RELEASE:
+            case EVENT_RECORD_KEY_PRESS:
             {
-               xcb_key_press_event_t* _key_event = (xcb_key_press_event_t*)_event;
-               u8 keycode = _key_event->detail;
-               bool32 is_down = (_event->response_type &~0x80) == XCB_KEY_PRESS ? TRUE : FALSE;
+               u8 keycode = record.value;
+               bool32 is_down = record.type == EVENT_RECORD_KEY_PRESS ? TRUE : FALSE;
 
-               if((_event->response_type &~0x80) == XCB_KEY_PRESS && !keys_down[keycode]) {
+               if(is_down && !keys_down[keycode]) {
                   keys_down[keycode] = 1;
-               } else if((_event->response_type &~0x80) == XCB_KEY_RELEASE) {
+               } else if(!is_down) {
                   keys_down[keycode] = 0;
                }
                if(keycode == 111) {
@@ -488,28 +3691,239 @@ int main() {
                   keyboard_input_process(&new_controller->action_right, is_down);
                }
             } break;
+            case EVENT_RECORD_REFRESH_CHANGE:
+            {
+               refresh_rate_changed = TRUE;
+            } break;
+         }
+      }
+
+      window_width  = pending_width;
+      window_height = pending_height;
+      if(!_xrender_available && (pending_width != global_backbuffers[0].width || pending_height != global_backbuffers[0].height)) {
+         for(u32 buffer_index=0; buffer_index < global_backbuffer_count; ++buffer_index) {
+            unflushed_resize_backbuffer(&global_backbuffers[buffer_index], pending_width, pending_height);
+         }
+         if(_pixel_format.convert) {
+            resize_canonical_buffer(&global_canonical_buffer, pending_width, pending_height);
+         }
+      }
+
+      if(refresh_rate_changed) {
+         refresh_rate_changed = FALSE;
+         randr_query_crtcs(&crtc_layout);
+         crtc_index = -1;
+         is_crtc_stale = TRUE;
+      }
+      if(is_position_stale) {
+         is_position_stale = FALSE;
+         window_root_position(&window_x, &window_y);
+      }
+      if(is_crtc_stale) {
+         is_crtc_stale = FALSE;
+         s32 new_crtc_index = crtc_layout_find(&crtc_layout, window_x + window_width / 2, window_y + window_height / 2);
+         if(new_crtc_index >= 0 && new_crtc_index != crtc_index) {
+            crtc_index = new_crtc_index;
+            f32 refresh_hz = crtc_layout.crtcs[crtc_index].refresh_hz;
+            if(refresh_hz > 0.0f && (int)(refresh_hz + 0.5f) != monitor_refresh_hz) {
+               monitor_refresh_hz = (int)(refresh_hz + 0.5f);
+               game_update_hz = monitor_refresh_hz / refreshes_per_frame;
+               target_seconds_per_frame = (f32)refreshes_per_frame / refresh_hz;
+               //Note(LAG): MSCs count per CRTC, the Present pacing starts measuring again on the new one
+               _present_timing.msc = 0;
+               _present_timing.seconds_per_refresh = 0.0f;
+            }
+         }
+      }
+
+      bool32 was_idle = is_idle;
+      is_idle = HANDMADE_IDLE && (!is_mapped || is_obscured || !is_focused);
+      if(is_idle) {
+         //Note(LAG): The device is stopped rather than left to underrun, and the clock restarts on wake so the game does not
+         //see the whole pause as one frame
+         if(!was_idle && !_audio_thread.is_running) {
+            COUNTED_SYSCALL(snd_pcm_drop(_pcm));
+         }
+         *old_input = *new_input;
+         last_counter = get_timeval();
+#if HANDMADE_TELEMETRY
+         last_cycle_count = __rdtsc();
+         last_x_bytes_written = xcb_total_written(_connection);
+#endif
+         xxcb_frame_stats zero_stats = {};
+         global_frame_stats = zero_stats;
+         continue;
+      } else if(was_idle && !_audio_thread.is_running) {
+         COUNTED_SYSCALL(snd_pcm_prepare(_pcm));
+      }
+
+      if(_present_available) {
+         while((_event = xcb_poll_for_special_event(_connection, _present_special_event))) {
+            present_process_event(_event);
          }
-         free(_event);
       }
 
-      snd_pcm_sframes_t delay;
-      snd_pcm_delay(_pcm, &delay);
-      int samples_to_write = sound_output.samples_per_write - delay;
+      int samples_to_write = 0;
+      bool32 is_sound_ready = reactor_sound_is_ready(&reactor, ready) || was_idle;
+      //Note(LAG): A wake on the PCM descriptors is not always room to write (a dmix timer, avail still under avail_min),
+      //the one shot descriptors are armed again whenever one fired or they stay quiet for good
+      bool32 is_sound_disarmed = (ready & REACTOR_SOURCE_SOUND) || was_idle;
+      if(_audio_thread.is_running) {
+         u32 queued = audio_ring_fill(&_audio_thread.ring) + __atomic_load_n(&_audio_thread.device_queued, __ATOMIC_ACQUIRE);
+         samples_to_write = queued < _audio_thread.ring_target ? _audio_thread.ring_target - queued : 0;
+         if(samples_to_write > _audio_thread.ring.frame_count - audio_ring_fill(&_audio_thread.ring)) {
+            samples_to_write = _audio_thread.ring.frame_count - audio_ring_fill(&_audio_thread.ring);
+         }
+      } else if(is_sound_ready && !audio_latency.pending_frames && COUNTED_SYSCALL(snd_pcm_status(_pcm, pcm_status)) == 0) {
+         f32 seconds_since_flip = get_seconds_elapsed(last_counter, get_timeval());
+         u32 samples_per_frame = (u32)(sound_output.samples_per_second * target_seconds_per_frame);
+         samples_to_write = audio_sync_frames_to_write(&audio_sync, pcm_status, sound_output.samples_per_second, samples_per_frame,
+                                                       seconds_since_flip, target_seconds_per_frame - seconds_since_flip);
+      }
+      //Note(LAG): The scratch was sized once, a device buffer bigger than that is filled over more than one frame
+      if((u32)samples_to_write > sample_capacity) {
+         samples_to_write = sample_capacity;
+      }
 
       game_sound_output_buffer sound_buffer = {};
       sound_buffer.samples_per_second = sound_output.samples_per_second;
       sound_buffer.sample_count = samples_to_write;
-      sound_buffer.samples = samples;
+      sound_buffer.samples = HANDMADE_AUDIO_FLOAT ? (void*)bus : (void*)samples;
+
+      u8* mmap_area = 0;
+      snd_pcm_uframes_t mmap_offset = 0;
+      snd_pcm_uframes_t mmap_frames = 0;
+      if(is_direct_mmap && samples_to_write > 0) {
+         //Note(LAG): The area can end at the wrap of the device ring before samples_to_write, the rest goes next frame
+         const snd_pcm_channel_area_t* _areas;
+         snd_pcm_sframes_t available = COUNTED_SYSCALL(snd_pcm_avail_update(_pcm));
+         if(available < 0) {
+            alsa_record_xrun();
+            COUNTED_SYSCALL(snd_pcm_recover(_pcm, available, 1));
+         }
+         mmap_frames = samples_to_write;
+         if(COUNTED_SYSCALL(snd_pcm_mmap_begin(_pcm, &_areas, &mmap_offset, &mmap_frames)) < 0) {
+            mmap_frames = 0;
+         } else {
+            mmap_area = (u8*)_areas[0].addr + _areas[0].first / 8 + mmap_offset * _areas[0].step / 8;
+            sound_buffer.samples = HANDMADE_AUDIO_FLOAT ? (void*)bus : (void*)mmap_area;
+         }
+         samples_to_write = mmap_frames;
+         sound_buffer.sample_count = mmap_frames;
+      }
+
+      global_backbuffer = acquire_backbuffer(global_backbuffer);
+
+      //Note(LAG): The game draws BGRX, into the backbuffer itself when the server uses the same layout
+      xxcb_offscreen_buffer* canonical_buffer = _pixel_format.convert ? &global_canonical_buffer : global_backbuffer;
 
       game_offscreen_buffer buffer = {};
-      buffer.memory = global_backbuffer.pixels;
-      buffer.width = global_backbuffer.width;
-      buffer.height = global_backbuffer.height;
-      buffer.pitch = global_backbuffer.pitch;
+      if(global_render_buffer.pixels) {
+         buffer.memory = global_render_buffer.pixels;
+         buffer.width = global_render_buffer.width;
+         buffer.height = global_render_buffer.height;
+         buffer.pitch = global_render_buffer.pitch;
+      } else {
+         buffer.memory = canonical_buffer->pixels;
+         buffer.width = canonical_buffer->width;
+         buffer.height = canonical_buffer->height;
+         buffer.pitch = canonical_buffer->pitch;
+      }
       game_update_render(&gmemory, new_input, &buffer, &sound_buffer);
+#if HANDMADE_INTERNAL
+      if(HANDMADE_AUDIO_SYNC_OVERLAY && buffer.memory && !_audio_thread.is_running) {
+         debug_draw_audio_sync(&buffer, &audio_sync, sound_output.samples_per_write);
+      }
+#endif
+
+      if(HANDMADE_CAPTURE && buffer.memory) {
+         //Note(LAG): A failed start is not retried, a path that cannot be opened would otherwise cost an open() every frame
+         if(!capture.is_running && !capture.frames_written && !capture.has_failed &&
+            !capture_start(&capture, HANDMADE_CAPTURE_PATH, HANDMADE_CAPTURE_FORMAT, buffer.width, buffer.height, game_update_hz)) {
+            capture.has_failed = TRUE;
+            char message[256];
+            int length = snprintf(message, sizeof(message), "capture to %s failed: %s\n", HANDMADE_CAPTURE_PATH, strerror(errno));
+            write(STDERR_FILENO, message, length);
+         }
+         if(capture.is_running) {
+            capture_submit_frame(&capture, buffer.memory, buffer.width, buffer.height, buffer.pitch);
+         }
+      }
+
+      if(global_render_buffer.pixels && canonical_buffer->pixels) {
+         u64 scale_start_cycles = __rdtsc();
+         stretch_blit(&global_render_buffer, canonical_buffer);
+         global_frame_stats.scale_cycles += __rdtsc() - scale_start_cycles;
+      }
+      if(_pixel_format.convert && global_backbuffer->pixels) {
+         pixel_convert_buffer(canonical_buffer, global_backbuffer);
+      }
+
+      //Note(LAG): The bus is converted in one pass straight into where the frames go next, the ring, the device or the scratch
+      if(_audio_thread.is_running) {
+         if(samples_to_write > 0) {
+            audio_ring_push(&_audio_thread.ring, sound_buffer.samples, sound_buffer.sample_count, audio_convert);
+            COUNTED_SYSCALL(sem_post(&_audio_thread.frames_ready));
+         }
+      } else if(is_direct_mmap) {
+         if(mmap_frames > 0) {
+            if(HANDMADE_AUDIO_FLOAT) {
+               audio_convert(bus, mmap_area, mmap_frames * 2);
+            }
+            audio_sync.frames_written += alsa_mmap_commit(mmap_offset, mmap_frames);
+         }
+      } else if(samples_to_write > 0) {
+         if(HANDMADE_AUDIO_FLOAT) {
+            audio_convert(bus, (u8*)samples, samples_to_write * 2);
+            sound_buffer.samples = (void*)samples;
+         }
+         //Note(LAG): samples_to_write only asks for what the device reported room for, waiting a quarter frame is plenty
+         audio_sync.frames_written += alsa_fill_sound_buffer(&sound_buffer, (int)(250.0f * target_seconds_per_frame));
+      }
+      if(is_sound_disarmed && !_audio_thread.is_running) {
+         reactor_rearm_sound(&reactor);
+      }
 
-      if(samples_to_write > 0) {
-         alsa_fill_sound_buffer(&sound_buffer);
+      if(_audio_thread.is_running) {
+         u32 thread_xruns = __atomic_exchange_n(&_audio_thread.xruns, 0, __ATOMIC_RELAXED);
+         while(thread_xruns--) {
+            alsa_record_xrun();
+         }
+      }
+      if(HANDMADE_AUDIO_ADAPTIVE && _audio_thread.is_running) {
+         _audio_thread.ring_target = audio_latency_adapt(&audio_latency, &_xrun_history, _audio_thread.ring_target);
+      } else if(HANDMADE_AUDIO_ADAPTIVE && audio_latency.pending_frames) {
+         //Note(LAG): Nothing is written while the queue plays out, the device is back in SETUP once it has
+         if(COUNTED_SYSCALL(snd_pcm_state(_pcm)) != SND_PCM_STATE_DRAINING) {
+            sound_output.samples_per_write = alsa_configure(sound_output.samples_per_second, audio_latency.pending_frames);
+            audio_latency.pending_frames = 0;
+            reactor_rearm_sound(&reactor);
+         }
+      } else if(HANDMADE_AUDIO_ADAPTIVE) {
+         u32 current_frames = sound_output.samples_per_write;
+         u32 target_frames = audio_latency_adapt(&audio_latency, &_xrun_history, current_frames);
+         u32 frames = target_frames == current_frames ? current_frames :
+                      (u32)alsa_accepted_buffer_size(sound_output.samples_per_second, target_frames);
+         if(target_frames != current_frames && (frames == current_frames || frames > audio_latency.max_frames)) {
+            //Note(LAG): The device rounds the request back to the size it has, or past the largest one the scratch holds,
+            //asking again in this direction never gets a usable size
+            if(target_frames > current_frames) {
+               audio_latency.max_frames = current_frames;
+            } else {
+               audio_latency.min_frames = current_frames;
+            }
+         } else if(frames > current_frames) {
+            //Note(LAG): The hw params only change on a stopped device. Growing follows xruns, so the sound already broke,
+            //what is queued is dropped and refilled with silence
+            COUNTED_SYSCALL(snd_pcm_drop(_pcm));
+            sound_output.samples_per_write = alsa_configure(sound_output.samples_per_second, frames);
+            audio_sync.frames_written += alsa_write_silence(sound_output.samples_per_write / 2, sound_output.bytes_per_sample);
+            reactor_rearm_sound(&reactor);
+         } else if(frames < current_frames) {
+            //Note(LAG): Shrinking lets what is queued play out instead, non blocking this only starts the drain
+            COUNTED_SYSCALL(snd_pcm_drain(_pcm));
+            audio_latency.pending_frames = frames;
+         }
       }
 
       struct timeval work_counter = get_timeval();
@@ -517,11 +3931,13 @@ int main() {
       f32 work_seconds_elapsed = get_seconds_elapsed(last_counter, work_counter);
       f32 seconds_elapsed_for_frame = work_seconds_elapsed;
 
-      if(seconds_elapsed_for_frame < target_seconds_per_frame) {
+      if(_present_available) {
+         //Note(LAG): Paced by present_wait_for_complete after the frame is queued
+      } else if(seconds_elapsed_for_frame < target_seconds_per_frame) {
          //Note(LAG) Due to granularity, it cannot hit the right amount of sleep time so we make it sleep for a little less time than what it should and the loop handle the rest
          s32 sleep_usecs = (s32)((1000.0f*980.0f) * (target_seconds_per_frame - seconds_elapsed_for_frame));
          if(sleep_usecs > 0) {
-            usleep(sleep_usecs);
+            reactor_wait_for_timer(&reactor, sleep_usecs);
          }
 
          while(seconds_elapsed_for_frame < target_seconds_per_frame) {
@@ -533,34 +3949,92 @@ int main() {
       }
 
       struct timeval end_counter = get_timeval();
+#if HANDMADE_TELEMETRY
       s64 end_cycle_count = __rdtsc();
+#endif
+
+      u16 width  = global_backbuffer->width;
+      u16 height = global_backbuffer->height;
+      if(_present_available) {
+         unflushed_present_window(global_backbuffer, refreshes_per_frame);
+         COUNTED_SYSCALL(xcb_flush(_connection));
+         present_wait_for_complete();
+
+         if(_present_timing.seconds_per_refresh > 0.0f) {
+            monitor_refresh_hz = (int)(1.0f / _present_timing.seconds_per_refresh + 0.5f);
+            game_update_hz = monitor_refresh_hz / refreshes_per_frame;
+            target_seconds_per_frame = _present_timing.seconds_per_refresh * refreshes_per_frame;
+         }
 
-      u16 width  = global_backbuffer.width;
-      u16 height = global_backbuffer.height;
-      unflushed_update_window(global_backbuffer, width, height);
-      xcb_flush(_connection);
+         end_counter = get_timeval();
+#if HANDMADE_TELEMETRY
+         end_cycle_count = __rdtsc();
+#endif
+      } else if(_xrender_available) {
+         //Note(LAG): Only the client side is measured here, the scaling itself happens in the server
+         u64 scale_start_cycles = __rdtsc();
+         unflushed_xrender_update_window(global_backbuffer, window_width, window_height);
+         global_frame_stats.scale_cycles += __rdtsc() - scale_start_cycles;
+         COUNTED_SYSCALL(xcb_flush(_connection));
+      } else {
+         unflushed_update_window(global_backbuffer, width, height);
+         COUNTED_SYSCALL(xcb_flush(_connection));
+      }
 
       game_input* temp = new_input;
       new_input = old_input;
       old_input = temp;
 
-#if 0
+#if HANDMADE_TELEMETRY
       u64 cycles_elapsed = end_cycle_count - last_cycle_count;
 
       f32 ms_per_frame = 1000.0f * get_seconds_elapsed(last_counter, end_counter);
       f32 fps = (1000.0f) / ms_per_frame;
       f32 mcpf = (f32)(cycles_elapsed / (1000.0f*1000.0f));
+      f32 dirty_ratio = global_frame_stats.tiles_total ? (f32)global_frame_stats.tiles_dirty / (f32)global_frame_stats.tiles_total : 1.0f;
+
+      //Note(LAG): Bytes are what xcb has handed to the socket, requests still sitting in its buffer show up next frame
+      u64 x_bytes_written = xcb_total_written(_connection);
 
       char char_buffer[256];
       int length;
-      length = sprintf(char_buffer, "%.2fms/f, %.2ff/s, %.2fmc/f\n", ms_per_frame, fps, mcpf);
+      f32 scale_mc = (f32)(global_frame_stats.scale_cycles / (1000.0f*1000.0f));
+      if(_audio_thread.is_running) {
+         global_frame_stats.pcm_short_writes += __atomic_exchange_n(&_audio_thread.short_writes, 0, __ATOMIC_RELAXED);
+      }
+      u32 audio_frames = _audio_thread.is_running ? _audio_thread.ring_target : (u32)sound_output.samples_per_write;
+      length = sprintf(char_buffer, "%.2fms/f, %.2ff/s, %.2fmc/f, %.1f%% dirty, %.2fmc scale (%s), %usc/f, %urt/f, %lluB/f to X, "
+                       "pcm %u short %u retry %u xrun (%u total, %.1fms queued)\n",
+                       ms_per_frame, fps, mcpf, 100.0f * dirty_ratio,
+                       scale_mc, _xrender_available ? "xrender" : "cpu",
+                       global_frame_stats.syscalls, global_frame_stats.round_trips,
+                       (unsigned long long)(x_bytes_written - last_x_bytes_written),
+                       global_frame_stats.pcm_short_writes, global_frame_stats.pcm_retries, global_frame_stats.pcm_xruns,
+                       _xrun_history.count, 1000.0f * audio_frames / sound_output.samples_per_second);
       write(STDOUT_FILENO, char_buffer, length);
+      last_x_bytes_written = x_bytes_written;
+      last_cycle_count = end_cycle_count;
 #endif
+      xxcb_frame_stats zero_stats = {};
+      global_frame_stats = zero_stats;
 
       last_counter = end_counter;
-      last_cycle_count = end_cycle_count;
    }
 
+   if(capture.is_running) {
+      capture_stop(&capture);
+   }
+   if(_event_thread.is_running) {
+      event_thread_stop(&_event_thread);
+   }
+   if(_audio_thread.is_running) {
+      audio_thread_stop(&_audio_thread);
+   }
+
+#if HANDMADE_TELEMETRY
+   xrun_history_dump(&_xrun_history, STDOUT_FILENO);
+#endif
+
    xcb_disconnect(_connection);
    return 0;
 }
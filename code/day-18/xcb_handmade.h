@@ -1,14 +1,218 @@
 #if !defined(XCB_HANDMADE)
 #define XCB_HANDMADE
 
+typedef enum page_kind {
+   PAGE_KIND_NORMAL,
+   PAGE_KIND_HUGETLB,
+   PAGE_KIND_TRANSPARENT,
+} page_kind;
+
 typedef struct xxcb_offscreen_buffer {
-   xcb_pixmap_t pixmap;
-   void*        pixels;
-   u16          width;
-   u16          height;
-   u16          pitch;
+   xcb_pixmap_t  pixmap;
+   xcb_shm_seg_t shm_segment;
+   void*         pixels;
+   u16           width;
+   u16           height;
+   u16           pitch;
+   u16           reserved_width;
+   u16           reserved_height;
+   bool32        is_busy;
+   xcb_pixmap_t  presented_pixmap;
+   u64*          tile_hashes;
+   u8*           tile_scratch;
+   bool32        tiles_valid;
+   page_kind     pages;
 } xxcb_offscreen_buffer;
 
+typedef enum stretch_filter {
+   STRETCH_FILTER_NEAREST,
+   STRETCH_FILTER_BILINEAR,
+} stretch_filter;
+
+typedef enum render_scaler {
+   RENDER_SCALER_CPU,
+   RENDER_SCALER_XRENDER,
+} render_scaler;
+
+typedef struct xxcb_render_buffer {
+   void*          pixels;
+   u16            width;
+   u16            height;
+   u16            pitch;
+   stretch_filter filter;
+   bool32         letterbox;
+   u32*           row_scratch;
+   u32*           column_sources;
+   u16*           column_weights;
+   u32            table_width;
+   stretch_filter table_filter;
+} xxcb_render_buffer;
+
+typedef void pixel_convert_function(u32* source, u8* destination, u32 count);
+
+//Note(LAG): Count is in samples, two per stereo frame
+typedef void audio_convert_function(f32* source, u8* destination, u32 count);
+
+typedef struct xxcb_pixel_format {
+   u8                      depth;
+   u8                      bits_per_pixel;
+   u8                      scanline_pad;
+   u32                     red_mask;
+   u32                     green_mask;
+   u32                     blue_mask;
+   bool32                  is_msb_first;
+   pixel_convert_function* convert;
+} xxcb_pixel_format;
+
+typedef struct xxcb_present_timing {
+   u32 serial;
+   u32 completed_serial;
+   u64 msc;
+   u64 ust;
+   f32 seconds_per_refresh;
+} xxcb_present_timing;
+
+typedef struct xxcb_frame_stats {
+   u32 tiles_total;
+   u32 tiles_dirty;
+   u64 scale_cycles;
+   u32 syscalls;
+   u32 round_trips;
+   u32 pcm_short_writes;
+   u32 pcm_retries;
+   u32 pcm_xruns;
+} xxcb_frame_stats;
+
+#define INDEX_RING_COUNT   8
+#define CAPTURE_SLOT_COUNT 4
+
+//Note(LAG): Single producer single consumer ring of indices, the count must be a power of two
+typedef struct xxcb_index_ring {
+   u32 read;
+   u32 write;
+   u32 values[INDEX_RING_COUNT];
+} xxcb_index_ring;
+
+typedef enum capture_format {
+   CAPTURE_FORMAT_Y4M,
+   CAPTURE_FORMAT_RAW,
+} capture_format;
+
+typedef struct xxcb_capture {
+   int             file_handle;
+   capture_format  format;
+   u16             width;
+   u16             height;
+   u32             frame_rate;
+   u8*             slots[CAPTURE_SLOT_COUNT];
+   u8*             yuv_frame;
+   xxcb_index_ring free_slots;
+   xxcb_index_ring filled_slots;
+   sem_t           frames_ready;
+   pthread_t       thread;
+   bool32          is_running;
+   bool32          has_failed;
+   int             write_error;
+   u32             frames_written;
+   u32             frames_dropped;
+} xxcb_capture;
+
+#define EVENT_RING_COUNT 256
+
+typedef enum event_record_type {
+   EVENT_RECORD_CLOSE,
+   EVENT_RECORD_CONFIGURE,
+   EVENT_RECORD_MAP,
+   EVENT_RECORD_VISIBILITY,
+   EVENT_RECORD_FOCUS,
+   EVENT_RECORD_EXPOSE,
+   EVENT_RECORD_KEY_PRESS,
+   EVENT_RECORD_KEY_RELEASE,
+   EVENT_RECORD_REFRESH_CHANGE,
+} event_record_type;
+
+//Note(LAG): value is the keycode, the expose count, the new state of map, visibility and focus or whether a configure
+//was synthetic
+typedef struct xxcb_event_record {
+   u8  type;
+   u8  value;
+   s16 x;
+   s16 y;
+   u16 width;
+   u16 height;
+} xxcb_event_record;
+
+#define RANDR_CRTC_COUNT 16
+
+//Note(LAG): The active CRTCs in root coordinates, refresh_hz is 0 when the mode is unknown
+typedef struct xxcb_crtc {
+   s16 x;
+   s16 y;
+   u16 width;
+   u16 height;
+   f32 refresh_hz;
+} xxcb_crtc;
+
+typedef struct xxcb_crtc_layout {
+   u32       count;
+   xxcb_crtc crtcs[RANDR_CRTC_COUNT];
+} xxcb_crtc_layout;
+
+typedef struct xxcb_event_ring {
+   u32               read;
+   u32               write;
+   xxcb_event_record records[EVENT_RING_COUNT];
+} xxcb_event_ring;
+
+typedef struct xxcb_event_thread {
+   pthread_t       thread;
+   xxcb_event_ring ring;
+   int             wake_descriptor;
+   sem_t           buffer_released;
+   bool32          is_running;
+} xxcb_event_thread;
+
+#define REACTOR_PCM_DESCRIPTOR_COUNT 4
+#define REACTOR_EVENT_COUNT          8
+
+typedef enum reactor_source {
+   REACTOR_SOURCE_X        = 1 << 0,
+   REACTOR_SOURCE_JOYSTICK = 1 << 1,
+   REACTOR_SOURCE_SOUND    = 1 << 2,
+   REACTOR_SOURCE_TIMER    = 1 << 3,
+} reactor_source;
+
+typedef struct xxcb_reactor {
+   int           epoll_descriptor;
+   int           timer_descriptor;
+   struct pollfd pcm_descriptors[REACTOR_PCM_DESCRIPTOR_COUNT];
+   u32           pcm_descriptor_count;
+   u32           ready;
+   bool32        has_waited;
+} xxcb_reactor;
+
+#if HANDMADE_WORK_QUEUE
+#define WORK_QUEUE_ENTRY_COUNT  256
+#define WORK_QUEUE_THREAD_COUNT 63
+
+typedef struct platform_work_queue_entry {
+   u32                           sequence;
+   platform_work_queue_callback* callback;
+   void*                         data;
+} platform_work_queue_entry;
+
+struct platform_work_queue {
+   u32                       completion_goal;
+   u32                       completion_count;
+   u32                       enqueue_position;
+   u32                       dequeue_position;
+   sem_t                     semaphore;
+   u32                       thread_count;
+   pthread_t                 threads[WORK_QUEUE_THREAD_COUNT];
+   platform_work_queue_entry entries[WORK_QUEUE_ENTRY_COUNT];
+};
+#endif
+
 typedef struct alsa_sound_output {
    int samples_per_second;
    int samples_per_write;
@@ -16,4 +220,60 @@ typedef struct alsa_sound_output {
    int tone_hz;
 } alsa_sound_output;
 
+//Note(LAG): Interleaved frames in the device format, the frame count is a power of two
+typedef struct xxcb_audio_ring {
+   u8* memory;
+   u32 frame_count;
+   u32 bytes_per_frame;
+   u32 read;
+   u32 write;
+} xxcb_audio_ring;
+
+typedef struct xxcb_audio_thread {
+   pthread_t       thread;
+   xxcb_audio_ring ring;
+   u32             ring_target;
+   u32             device_frames;
+   u32             samples_per_second;
+   sem_t           frames_ready;
+   u32             device_queued;
+   u32             silence_frames;
+   u32             short_writes;
+   u32             xruns;
+   bool32          is_running;
+   bool32          is_realtime;
+} xxcb_audio_thread;
+
+#define XRUN_HISTORY_COUNT 64
+
+//Note(LAG): Every xrun since start, the times of the last XRUN_HISTORY_COUNT of them are kept on CLOCK_MONOTONIC
+typedef struct xxcb_xrun_history {
+   u32             count;
+   struct timespec times[XRUN_HISTORY_COUNT];
+} xxcb_xrun_history;
+
+typedef struct xxcb_audio_latency {
+   u32             min_frames;
+   u32             max_frames;
+   u32             pending_frames;
+   struct timespec last_change;
+} xxcb_audio_latency;
+
+#define AUDIO_SYNC_MARKER_COUNT 32
+
+//Note(LAG): Cursors are absolute frame counts since the device was opened, the overlay wraps them on the device buffer
+typedef struct xxcb_audio_sync_marker {
+   u64 play_cursor;
+   u64 predicted_flip_cursor;
+   u64 actual_flip_cursor;
+   u64 write_end;
+} xxcb_audio_sync_marker;
+
+typedef struct xxcb_audio_sync {
+   u64                    frames_written;
+   u32                    marker_index;
+   bool32                 has_prediction;
+   xxcb_audio_sync_marker markers[AUDIO_SYNC_MARKER_COUNT];
+} xxcb_audio_sync;
+
 #endif
@@ -5,6 +5,7 @@
 */
 #include <xcb/xcb.h>
 #include <malloc.h>
+#include <poll.h>
 
 #include <sys/shm.h>
 #include <xcb/shm.h> /*libxcb-shm0-dev Package Required*/
@@ -154,6 +155,15 @@ int main() {
       while ((_event = xcb_poll_for_event(_connection))) {
          handle_event(_event);
       }
+      //Note(LAG): WM_DELETE_WINDOW only clears is_running, no more X traffic comes to wake the poll below
+      if(!is_running || xcb_connection_has_error(_connection)) {
+         break;
+      }
+
+      //Note(LAG): Nothing here redraws on its own, only Expose does, so with the queue drained the loop sleeps
+      //until the server sends something instead of spinning on xcb_poll_for_event
+      struct pollfd _descriptor = {xcb_get_file_descriptor(_connection), POLLIN, 0};
+      poll(&_descriptor, 1, -1);
    }
 
    xcb_disconnect(_connection);